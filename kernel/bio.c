@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -23,70 +23,205 @@
 #include "fs.h"
 #include "buf.h"
 
+#define NBUCKET 13
+
+// bcache被分成NBUCKET个哈希桶，按照(dev, blockno)散列。
+// 每个桶有自己的锁，查找一个已经缓存的块只需要拿对应桶的锁。
+// bcache.lock只在淘汰(换出)的时候使用，保证同一时刻只有一个
+// CPU在多个桶之间搬动buf，所以也只有它会同时持有多个桶锁。
+// buf来自一个kcache：不到NBUF个的时候新建，之后只有在
+// 所有buf都被占用时才新建，否则淘汰最久没用的。
 struct {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct kcache *cache;
+  int nbuf;             // bufs made so far; protected by lock
 
-  // Linked list of all buffers, through prev/next.
-  // head.next is most recently used.
-  struct buf head;
+  // Hash chains of buffers, through prev/next.
+  // A buf's bucket lock protects its refcnt and timestamp,
+  // and its place on the chain.
+  struct {
+    struct spinlock lock;
+    struct buf head;
+  } bucket[NBUCKET];
 } bcache;
 // block cache.
 
+static char *bucket_names[NBUCKET] = {
+  "bcache.bucket0", "bcache.bucket1", "bcache.bucket2", "bcache.bucket3",
+  "bcache.bucket4", "bcache.bucket5", "bcache.bucket6", "bcache.bucket7",
+  "bcache.bucket8", "bcache.bucket9", "bcache.bucket10", "bcache.bucket11",
+  "bcache.bucket12",
+};
+
+static uint
+bhash(uint dev, uint blockno)
+{
+  return (dev * 31 + blockno) % NBUCKET;
+}
+
+// unlink b from whatever hash chain it is on.
+static void
+bunlink(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+}
+
+// push b onto the front of bucket i's chain.
+static void
+blink(int i, struct buf *b)
+{
+  struct buf *head = &bcache.bucket[i].head;
+
+  b->next = head->next;
+  b->prev = head;
+  head->next->prev = b;
+  head->next = b;
+}
 
-// bcache的数据在buf.data中保存，在这儿我们初始化bcache双向链表这个数据结构
+// bcache的数据在buf.data中保存，在这儿初始化每个哈希桶的双向链表
+// 一开始一个buf都没有，bget()用到的时候再新建
 void
 binit(void)
+{
+  initlock(&bcache.lock, "bcache");
+  bcache.cache = kcachecreate("buf", sizeof(struct buf));
+
+  for(int i = 0; i < NBUCKET; i++){
+    initlock(&bcache.bucket[i].lock, bucket_names[i]);
+    bcache.bucket[i].head.prev = &bcache.bucket[i].head;
+    bcache.bucket[i].head.next = &bcache.bucket[i].head;
+  }
+}
+
+// Make a new buf. Caller holds bcache.lock.
+// Returns 0 if out of memory.
+static struct buf*
+bnew(void)
 {
   struct buf *b;
 
-  initlock(&bcache.lock, "bcache");
+  if((b = kcachealloc(bcache.cache)) == 0)
+    return 0;
+  memset(b, 0, sizeof(*b));
+  initobjsleeplock(&b->lock, "buffer");
+  bcache.nbuf++;
+  return b;
+}
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+// Look through bucket i for block on device dev.
+// Caller holds the bucket lock.
+static struct buf*
+blookup(int i, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bcache.bucket[i].head.next; b != &bcache.bucket[i].head; b = b->next){
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
   }
+  return 0;
 }
 
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return locked buffer.
+// For readahead (ra set), return 0 instead if the block is
+// already cached or if no buffer is free.
 static struct buf*
-bget(uint dev, uint blockno)
+bget(uint dev, uint blockno, int ra)
 {
-  struct buf *b;
+  struct buf *b, *victim;
+  int i, vi;
 
-  acquire(&bcache.lock);
+  i = bhash(dev, blockno);
+  acquire(&bcache.bucket[i].lock);
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
+  if((b = blookup(i, dev, blockno)) != 0){
+    if(ra){
+      release(&bcache.bucket[i].lock);
+      return 0;
+    }
+    b->refcnt++;
+    release(&bcache.bucket[i].lock);
+    acquiresleep(&b->lock);
+    return b;
+  }
+  release(&bcache.bucket[i].lock);
+
+  // Not cached; recycle the least recently used unused buffer.
+  // Serialize eviction, then look again in case another CPU
+  // brought the block in while we held no locks.
+  acquire(&bcache.lock);
+  acquire(&bcache.bucket[i].lock);
+  if((b = blookup(i, dev, blockno)) != 0){
+    if(ra){
+      release(&bcache.bucket[i].lock);
       release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+      return 0;
     }
+    b->refcnt++;
+    release(&bcache.bucket[i].lock);
+    release(&bcache.lock);
+    acquiresleep(&b->lock);
+    return b;
+  }
+
+  // Until there are NBUF buffers, make a new one.
+  victim = 0;
+  if(bcache.nbuf < NBUF && (victim = bnew()) != 0){
+    blink(i, victim);
+    goto claim;
   }
 
-  // Not cached; recycle an unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
+  // Scan every bucket for the oldest buffer with refcnt 0,
+  // keeping the lock of the bucket that holds the current
+  // candidate (and always bucket i's lock).
+  vi = -1;
+  for(int j = 0; j < NBUCKET; j++){
+    int found = 0;
+    if(j != i)
+      acquire(&bcache.bucket[j].lock);
+    for(b = bcache.bucket[j].head.next; b != &bcache.bucket[j].head; b = b->next){
+      if(b->refcnt == 0 && (victim == 0 || b->timestamp < victim->timestamp)){
+        victim = b;
+        found = 1;
+      }
+    }
+    if(found){
+      if(vi >= 0 && vi != i && vi != j)
+        release(&bcache.bucket[vi].lock);
+      vi = j;
+    } else if(j != i){
+      release(&bcache.bucket[j].lock);
+    }
+  }
+  if(victim == 0){
+    if(ra){
+      release(&bcache.bucket[i].lock);
       release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+      return 0;
     }
+    // every buffer is in use; grow the cache past NBUF.
+    if((victim = bnew()) == 0)
+      panic("bget: no buffers");
+    blink(i, victim);
+  } else if(vi != i){
+    bunlink(victim);
+    blink(i, victim);
+    release(&bcache.bucket[vi].lock);
   }
-  panic("bget: no buffers");
+
+claim:
+  victim->dev = dev;
+  victim->blockno = blockno;
+  victim->valid = 0;
+  victim->refcnt = 1;
+  release(&bcache.bucket[i].lock);
+  release(&bcache.lock);
+  acquiresleep(&victim->lock);
+  return victim;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -95,7 +230,7 @@ bread(uint dev, uint blockno)
 {
   struct buf *b;
 
-  b = bget(dev, blockno);
+  b = bget(dev, blockno, 0);
   if(!b->valid) {
     virtio_disk_rw(b->dev, b, 0);
     b->valid = 1;
@@ -103,6 +238,86 @@ bread(uint dev, uint blockno)
   return b;
 }
 
+// Return a locked buf for the indicated block without reading
+// it from disk, for a caller that will overwrite all of b->data.
+struct buf*
+bclaim(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno, 0);
+  b->valid = 1;
+  return b;
+}
+
+// Return a locked buf with the contents of the indicated block
+// if it is cached and no one holds it; otherwise return 0
+// without waiting.
+struct buf*
+btryread(uint dev, uint blockno)
+{
+  struct buf *b;
+  int i = bhash(dev, blockno);
+
+  acquire(&bcache.bucket[i].lock);
+  if((b = blookup(i, dev, blockno)) != 0)
+    b->refcnt++;
+  release(&bcache.bucket[i].lock);
+  if(b == 0)
+    return 0;
+  if(!tryacquiresleep(&b->lock)){
+    bunpin(b);
+    return 0;
+  }
+  if(!b->valid){
+    brelse(b);
+    return 0;
+  }
+  return b;
+}
+
+// Start reading blocks blockno[0..n-1] into the cache, without
+// waiting for them. Blocks already cached are skipped. Each buf
+// stays locked until bdone() is called on it when its read
+// completes, so a bread() of the block meanwhile waits for it.
+void
+breadahead(uint dev, uint *blockno, int n)
+{
+  struct buf *b[MAXRA];
+  int nb = 0;
+
+  if(n > MAXRA)
+    panic("breadahead");
+  for(int i = 0; i < n; i++){
+    if((b[nb] = bget(dev, blockno[i], 1)) != 0){
+      b[nb]->async = 1;
+      nb++;
+    }
+  }
+  if(nb > 0)
+    virtio_disk_start(dev, b, nb, 0);
+}
+
+// Called by the disk driver, from the disk interrupt, when a
+// readahead read of b completes. Like brelse(), except that
+// the interrupted process does not own b's lock.
+void
+bdone(struct buf *b)
+{
+  int i;
+
+  b->async = 0;
+  b->valid = 1;
+  releasesleep(&b->lock);
+
+  i = bhash(b->dev, b->blockno);
+  acquire(&bcache.bucket[i].lock);
+  b->refcnt--;
+  if (b->refcnt == 0)
+    b->timestamp = ticks;
+  release(&bcache.bucket[i].lock);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -112,43 +327,59 @@ bwrite(struct buf *b)
   virtio_disk_rw(b->dev, b, 1);
 }
 
+// Write bufs b[0..n-1], all locked and on one device, as a
+// single batch of disk requests, and wait for them all.
+void
+bwritev(struct buf **b, int n)
+{
+  for(int i = 0; i < n; i++){
+    if(!holdingsleep(&b[i]->lock))
+      panic("bwritev");
+  }
+  if(n > 0){
+    virtio_disk_start(b[0]->dev, b, n, 1);
+    virtio_disk_wait(b[0]->dev, b, n);
+  }
+}
+
 // Release a locked buffer.
-// Move to the head of the MRU list.
+// Stamp it with the release time for LRU eviction in bget().
 void
 brelse(struct buf *b)
 {
+  int i;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  i = bhash(b->dev, b->blockno);
+  acquire(&bcache.bucket[i].lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->timestamp = ticks;
   }
-  
-  release(&bcache.lock);
+  release(&bcache.bucket[i].lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  int i = bhash(b->dev, b->blockno);
+
+  acquire(&bcache.bucket[i].lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bcache.bucket[i].lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  int i = bhash(b->dev, b->blockno);
+
+  acquire(&bcache.bucket[i].lock);
   b->refcnt--;
-  release(&bcache.lock);
+  if (b->refcnt == 0)
+    b->timestamp = ticks;
+  release(&bcache.bucket[i].lock);
 }
-
-
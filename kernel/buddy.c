@@ -19,46 +19,57 @@ static int nsizes;     // the number of entries in bd_sizes array
 typedef struct list Bd_list;
 
 // The allocator has sz_info for each size k. Each sz_info has a free
-// list, an array alloc to keep track which blocks have been
-// allocated, and an split array to to keep track which blocks have
-// been split.  The arrays are of type char (which is 1 byte), but the
-// allocator uses 1 bit per block (thus, one char records the info of
-// 8 blocks).
+// list, an array pair with one bit for each pair of buddies at size
+// k, and an array split to keep track which blocks have been split.
+// A pair bit is the XOR of whether the two buddies are allocated: it
+// is 1 when exactly one of them is, so freeing a block whose pair
+// bit flips to 0 means its buddy is free too and they can merge.
+// The arrays are of type uint64 and are updated a word at a time
+// with atomic operations, since CPUs holding different sizes' locks
+// may touch bits in the same word.
+//
+// Each size has its own lock, protecting its free list and its pair
+// bits. bd_malloc() and bd_free() hold only one size's lock at a
+// time while they walk up or down the sizes; a block on its way
+// between two sizes is on no free list and counts as allocated at
+// the size above, so nobody else can merge with it meanwhile.
 struct sz_info {
+  struct spinlock lock;
   Bd_list free;
-  char *alloc;
-  char *split;
+  uint64 *pair;
+  uint64 *split;
 };
 typedef struct sz_info Sz_info;
 
 static Sz_info *bd_sizes; 
 static void *bd_base;   // start address of memory managed by the buddy allocator
-static struct spinlock lock;
+
+#define WORD(index)   ((index) / 64)
+#define MASK(index)   (1UL << ((index) % 64))
 
 // Return 1 if bit at position index in array is set to 1
-int bit_isset(char *array, int index) {
-  char b = array[index/8];
-  char m = (1 << (index % 8));
-  return (b & m) == m;
+int bit_isset(uint64 *array, int index) {
+  return (array[WORD(index)] & MASK(index)) != 0;
 }
 
 // Set bit at position index in array to 1
-void bit_set(char *array, int index) {
-  char b = array[index/8];
-  char m = (1 << (index % 8));
-  array[index/8] = (b | m);
+void bit_set(uint64 *array, int index) {
+  __sync_fetch_and_or(&array[WORD(index)], MASK(index));
 }
 
 // Clear bit at position index in array
-void bit_clear(char *array, int index) {
-  char b = array[index/8];
-  char m = (1 << (index % 8));
-  array[index/8] = (b & ~m);
+void bit_clear(uint64 *array, int index) {
+  __sync_fetch_and_and(&array[WORD(index)], ~MASK(index));
+}
+
+// Flip bit at position index in array, and return its new value
+int bit_flip(uint64 *array, int index) {
+  return (__sync_fetch_and_xor(&array[WORD(index)], MASK(index)) & MASK(index)) == 0;
 }
 
 // Print a bit vector as a list of ranges of 1 bits
 void
-bd_print_vector(char *vector, int len) {
+bd_print_vector(uint64 *vector, int len) {
   int last, lb;
   
   last = 1;
@@ -83,8 +94,10 @@ bd_print() {
   for (int k = 0; k < nsizes; k++) {
     printf("size %d (blksz %d nblk %d): free list: ", k, BLK_SIZE(k), NBLK(k));
     lst_print(&bd_sizes[k].free);
-    printf("  alloc:");
-    bd_print_vector(bd_sizes[k].alloc, NBLK(k));
+    if(k < MAXSIZE) {
+      printf("  pair:");
+      bd_print_vector(bd_sizes[k].pair, NBLK(k)/2);
+    }
     if(k > 0) {
       printf("  split:");
       bd_print_vector(bd_sizes[k].split, NBLK(k));
@@ -123,32 +136,35 @@ void *
 bd_malloc(uint64 nbytes)
 {
   int fk, k;
-
-  acquire(&lock);
+  char *p = 0;
 
   // Find a free block >= nbytes, starting with smallest k possible
   fk = firstk(nbytes);
   for (k = fk; k < nsizes; k++) {
-    if(!lst_empty(&bd_sizes[k].free))
+    acquire(&bd_sizes[k].lock);
+    if(!lst_empty(&bd_sizes[k].free)) {
+      p = lst_pop(&bd_sizes[k].free);
+      bit_flip(bd_sizes[k].pair, blk_index(k, p) / 2);
+      release(&bd_sizes[k].lock);
       break;
+    }
+    release(&bd_sizes[k].lock);
   }
   if(k >= nsizes) { // No free blocks?
-    release(&lock);
     return 0;
   }
 
-  // Found a block; pop it and potentially split it.
-  char *p = lst_pop(&bd_sizes[k].free);
-  bit_set(bd_sizes[k].alloc, blk_index(k, p));
+  // Found a block; split it down to size fk.
   for(; k > fk; k--) {
-    // split a block at size k and mark one half allocated at size k-1
-    // and put the buddy on the free list at size k-1
+    // split a block at size k, keep the first half allocated at
+    // size k-1 and put the buddy on the free list at size k-1
     char *q = p + BLK_SIZE(k-1);   // p's buddy
     bit_set(bd_sizes[k].split, blk_index(k, p));
-    bit_set(bd_sizes[k-1].alloc, blk_index(k-1, p));
+    acquire(&bd_sizes[k-1].lock);
+    bit_flip(bd_sizes[k-1].pair, blk_index(k-1, p) / 2);
     lst_push(&bd_sizes[k-1].free, q);
+    release(&bd_sizes[k-1].lock);
   }
-  release(&lock);
 
   return p;
 }
@@ -156,7 +172,7 @@ bd_malloc(uint64 nbytes)
 // Find the size of the block that p points to.
 int
 size(char *p) {
-  for (int k = 0; k < nsizes; k++) {
+  for (int k = 0; k < MAXSIZE; k++) {
     if(bit_isset(bd_sizes[k+1].split, blk_index(k+1, p))) {
       return k;
     }
@@ -171,17 +187,17 @@ bd_free(void *p) {
   void *q;
   int k;
 
-  acquire(&lock);
   for (k = size(p); k < MAXSIZE; k++) {
     int bi = blk_index(k, p);
-    int buddy = (bi % 2 == 0) ? bi+1 : bi-1;
-    bit_clear(bd_sizes[k].alloc, bi);  // free p at size k
-    if (bit_isset(bd_sizes[k].alloc, buddy)) {  // is buddy allocated?
-      break;   // break out of loop
+    int buddy = bi ^ 1;
+    acquire(&bd_sizes[k].lock);
+    if (bit_flip(bd_sizes[k].pair, bi / 2)) {  // is buddy allocated?
+      break;   // break out of loop, holding size k's lock
     }
-    // budy is free; merge with buddy
+    // buddy is free; merge with buddy
     q = addr(k, buddy);
     lst_remove(q);    // remove buddy from free list
+    release(&bd_sizes[k].lock);
     if(buddy % 2 == 0) {
       p = q;
     }
@@ -189,8 +205,10 @@ bd_free(void *p) {
     // anymore
     bit_clear(bd_sizes[k+1].split, blk_index(k+1, p));
   }
+  if(k == MAXSIZE)
+    acquire(&bd_sizes[k].lock);
   lst_push(&bd_sizes[k].free, p);
-  release(&lock);
+  release(&bd_sizes[k].lock);
 }
 
 // Compute the first block at size k that doesn't contain p
@@ -212,7 +230,9 @@ log2(uint64 n) {
   return k;
 }
 
-// Mark memory from [start, stop), starting at size 0, as allocated. 
+// Mark memory from [start, stop), starting at size 0, as allocated:
+// every block at size k > 0 that overlaps it counts as split.
+// The pair bits are set afterwards, by bd_initfree().
 void
 bd_mark(void *start, void *stop)
 {
@@ -221,29 +241,33 @@ bd_mark(void *start, void *stop)
   if (((uint64) start % LEAF_SIZE != 0) || ((uint64) stop % LEAF_SIZE != 0))
     panic("bd_mark");
 
-  for (int k = 0; k < nsizes; k++) {
+  for (int k = 1; k < nsizes; k++) {
     bi = blk_index(k, start);
     bj = blk_index_next(k, stop);
     for(; bi < bj; bi++) {
-      if(k > 0) {
-        // if a block is allocated at size k, mark it as split too.
-        bit_set(bd_sizes[k].split, bi);
-      }
-      bit_set(bd_sizes[k].alloc, bi);
+      bit_set(bd_sizes[k].split, bi);
     }
   }
 }
 
-// If a block is marked as allocated and the buddy is free, put the
-// buddy on the free list at size k.
+// Is block bi at size k wholly inside the free range [left, right)?
 int
-bd_initfree_pair(int k, int bi) {
-  int buddy = (bi % 2 == 0) ? bi+1 : bi-1;
+bd_isfree(int k, int bi, char *left, char *right) {
+  char *a = addr(k, bi);
+  return a >= left && a + BLK_SIZE(k) <= right;
+}
+
+// If one of block bi and its buddy is free and the other is not,
+// set their pair bit and put the free one on the free list at size k.
+int
+bd_initfree_pair(int k, int bi, char *left, char *right) {
+  int buddy = bi ^ 1;
   int free = 0;
-  if(bit_isset(bd_sizes[k].alloc, bi) !=  bit_isset(bd_sizes[k].alloc, buddy)) {
+  if(bd_isfree(k, bi, left, right) != bd_isfree(k, buddy, left, right)) {
     // one of the pair is free
     free = BLK_SIZE(k);
-    if(bit_isset(bd_sizes[k].alloc, bi))
+    bit_set(bd_sizes[k].pair, bi / 2);
+    if(bd_isfree(k, buddy, left, right))
       lst_push(&bd_sizes[k].free, addr(k, buddy));   // put buddy on free list
     else
       lst_push(&bd_sizes[k].free, addr(k, bi));      // put bi on free list
@@ -261,10 +285,10 @@ bd_initfree(void *bd_left, void *bd_right) {
   for (int k = 0; k < MAXSIZE; k++) {   // skip max size
     int left = blk_index_next(k, bd_left);
     int right = blk_index(k, bd_right);
-    free += bd_initfree_pair(k, left);
-    if(right <= left)
+    free += bd_initfree_pair(k, left, bd_left, bd_right);
+    if(right / 2 <= left / 2)
       continue;
-    free += bd_initfree_pair(k, right);
+    free += bd_initfree_pair(k, right, bd_left, bd_right);
   }
   return free;
 }
@@ -297,7 +321,6 @@ bd_init(void *base, void *end) {
   char *p = (char *) ROUNDUP((uint64)base, LEAF_SIZE);
   int sz;
 
-  initlock(&lock, "buddy");
   bd_base = (void *) p;
 
   // compute the number of sizes we need to manage [base, end)
@@ -313,21 +336,27 @@ bd_init(void *base, void *end) {
   bd_sizes = (Sz_info *) p;
   p += sizeof(Sz_info) * nsizes;
   memset(bd_sizes, 0, sizeof(Sz_info) * nsizes);
+  p = (char *) ROUNDUP((uint64) p, sizeof(uint64));
 
-  // initialize free list and allocate the alloc array for each size k
+  // initialize lock and free list and allocate the pair array for
+  // each size k, one bit per pair of blocks. the max size has
+  // no buddy, so no pair array.
   for (int k = 0; k < nsizes; k++) {
+    initlock(&bd_sizes[k].lock, "buddy");
     lst_init(&bd_sizes[k].free);
-    sz = sizeof(char)* ROUNDUP(NBLK(k), 8)/8;
-    bd_sizes[k].alloc = p;
-    memset(bd_sizes[k].alloc, 0, sz);
+    if(k == MAXSIZE)
+      continue;
+    sz = sizeof(uint64) * ROUNDUP(NBLK(k)/2, 64)/64;
+    bd_sizes[k].pair = (uint64 *) p;
+    memset(bd_sizes[k].pair, 0, sz);
     p += sz;
   }
 
   // allocate the split array for each size k, except for k = 0, since
   // we will not split blocks of size k = 0, the smallest size.
   for (int k = 1; k < nsizes; k++) {
-    sz = sizeof(char)* (ROUNDUP(NBLK(k), 8))/8;
-    bd_sizes[k].split = p;
+    sz = sizeof(uint64) * ROUNDUP(NBLK(k), 64)/64;
+    bd_sizes[k].split = (uint64 *) p;
     memset(bd_sizes[k].split, 0, sz);
     p += sz;
   }
@@ -351,4 +380,3 @@ bd_init(void *base, void *end) {
     panic("bd_init: free mem");
   }
 }
-
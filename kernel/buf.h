@@ -1,11 +1,13 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  int async;   // readahead: bdone() releases it when the disk is done
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  uint timestamp;   // ticks at last release, for LRU eviction
+  struct buf *prev; // hash bucket list
   struct buf *next;
   uchar data[BSIZE];
 };
@@ -59,22 +59,26 @@ struct {
 
 //
 // user write()s to the console go here.
+// the bytes are copied in a chunk at a time before cons.lock
+// is taken, since a fault on src may sleep.
 //
 int
 consolewrite(struct file *f, int user_src, uint64 src, int n)
 {
-  int i;
+  int i, j, m;
+  char buf[64];
 
-  acquire(&cons.lock);
-  for(i = 0; i < n; i++){
-    char c;
-    if(either_copyin(&c, user_src, src+i, 1) == -1)
+  for(i = 0; i < n; i += m){
+    m = n - i < sizeof(buf) ? n - i : sizeof(buf);
+    if(either_copyin(buf, user_src, src+i, m) == -1)
       break;
-    consputc(c);
+    acquire(&cons.lock);
+    for(j = 0; j < m; j++)
+      consputc(buf[j]);
+    release(&cons.lock);
   }
-  release(&cons.lock);
 
-  return n;
+  return i;
 }
 
 //
@@ -82,17 +86,21 @@ consolewrite(struct file *f, int user_src, uint64 src, int n)
 // copy (up to) a whole input line to dst.
 // user_dist indicates whether dst is a user
 // or kernel address.
+// the bytes are taken a chunk at a time under cons.lock
+// and copied out after it is released, since a fault on
+// dst may sleep.
 //
 int
 consoleread(struct file *f, int user_dst, uint64 dst, int n)
 {
   uint target;
-  int c;
-  char cbuf;
+  int c, m, done;
+  char buf[64];
 
   target = n;
-  acquire(&cons.lock);
-  while(n > 0){
+  done = 0;
+  while(n > 0 && !done){
+    acquire(&cons.lock);
     // wait until interrupt handler has put some
     // input into cons.buffer.
     while(cons.r == cons.w){
@@ -103,32 +111,37 @@ consoleread(struct file *f, int user_dst, uint64 dst, int n)
       sleep(&cons.r, &cons.lock);
     }
 
-    c = cons.buf[cons.r++ % INPUT_BUF];
+    for(m = 0; m < n && m < sizeof(buf) && cons.r != cons.w; ){
+      c = cons.buf[cons.r++ % INPUT_BUF];
+
+      if(c == C('D')){  // end-of-file
+        if(m > 0 || n < target){
+          // Save ^D for next time, to make sure
+          // caller gets a 0-byte result.
+          cons.r--;
+        }
+        done = 1;
+        break;
+      }
+
+      buf[m++] = c;
 
-    if(c == C('D')){  // end-of-file
-      if(n < target){
-        // Save ^D for next time, to make sure
-        // caller gets a 0-byte result.
-        cons.r--;
+      if(c == '\n'){
+        // a whole line has arrived, return to
+        // the user-level read().
+        done = 1;
+        break;
       }
-      break;
     }
+    release(&cons.lock);
 
-    // copy the input byte to the user-space buffer.
-    cbuf = c;
-    if(either_copyout(user_dst, dst, &cbuf, 1) == -1)
+    // copy the input bytes to the user-space buffer.
+    if(m > 0 && either_copyout(user_dst, dst, buf, m) == -1)
       break;
 
-    dst++;
-    --n;
-
-    if(c == '\n'){
-      // a whole line has arrived, return to
-      // the user-level read().
-      break;
-    }
+    dst += m;
+    n -= m;
   }
-  release(&cons.lock);
 
   return target - n;
 }
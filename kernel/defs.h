@@ -12,8 +12,13 @@ struct superblock;
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+struct buf*     bclaim(uint, uint);
+struct buf*     btryread(uint, uint);
+void            breadahead(uint, uint*, int);
+void            bdone(struct buf*);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwritev(struct buf**, int);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
 
@@ -24,6 +29,12 @@ void            consputc(int);
 
 // exec.c
 int             exec(char*, char**);
+void            textfree(struct inode*);
+struct inode*   exedup(struct inode*);
+void            exeput(struct inode*);
+uint64          segfault(struct proc*, uint64);
+int             segoverlap(struct proc*, uint64, uint64);
+void            segtrim(struct proc*, uint64);
 
 // file.c
 struct file*    filealloc(void);
@@ -50,6 +61,7 @@ int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
+void            ireadahead(struct inode*, uint, int);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
 
@@ -58,10 +70,29 @@ void            ramdiskinit(void);
 void            ramdiskintr(void);
 void            ramdiskrw(struct buf*);
 
+// futex.c
+void            futexinit(void);
+int             futexwait(uint64, int);
+int             futexwake(uint64);
+
 // kalloc.c
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit();
+void            kref(void *);
+int             krefcount(void *);
+void*           ksuperalloc(void);
+void            ksuperfree(void *);
+void            ksplit(void *);
+void*           kalloc_zeroed(void);
+int             kzerofill(void);
+
+// mmap.c
+uint64          vmamap(struct file*, uint64, int, int, uint64);
+int             vmaunmap(struct proc*, uint64, uint64);
+uint64          vmafault(struct proc*, uint64);
+void            vmafree(struct proc*);
+int             vmacopy(struct proc*, struct proc*);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -71,6 +102,7 @@ void            end_op(int);
 void            crash_op(int,int);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
@@ -85,7 +117,8 @@ void            printfinit(void);
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
-int             growproc(int);
+int             clone(uint64, uint64, uint64);
+uint64          growproc(int);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
@@ -100,6 +133,10 @@ void            sleep(void*, struct spinlock*);
 void            userinit(void);
 int             wait(uint64);
 void            wakeup(void*);
+void            wakeproc(struct proc*);
+int             proctick(void);
+void            prioboost(void);
+int             setpriority(int, int);
 void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
@@ -112,6 +149,7 @@ void            swtch(struct context*, struct context*);
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
 void            initlock(struct spinlock*, char*);
+void            initobjlock(struct spinlock*, char*);
 void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
@@ -119,9 +157,11 @@ uint64          sys_ntas(void);
 
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
+int             tryacquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
+void            initobjsleeplock(struct sleeplock*, char*);
 
 // string.c
 int             memcmp(const void*, const void*, uint);
@@ -140,6 +180,11 @@ int             fetchstr(uint64, char*, int);
 int             fetchaddr(uint64, uint64*);
 void            syscall();
 
+// timer.c
+void            settimer(struct proc*, uint);
+void            canceltimer(struct proc*);
+void            timertick(void);
+
 // trap.c
 extern uint     ticks;
 void            trapinit(void);
@@ -158,19 +203,37 @@ void            kvminit(void);
 void            kvminithart(void);
 uint64          kvmpa(uint64);
 void            kvmmap(uint64, uint64, uint64, int);
+void            kvmunmap(uint64);
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
 pagetable_t     uvmcreate(void);
 void            uvminit(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmshare(pagetable_t, pagetable_t, uint64, uint64, int);
+int             uvmcow(pagetable_t, uint64);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
 uint64          walkaddr(pagetable_t, uint64);
+uint64          vmfault(pagetable_t, uint64, int);
+int             uvmresident(uint64, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
+uint64          uvmasid(struct proc *);
+void            uvmflush(pagetable_t, uint64);
+void            uvmshootdown(struct proc*);
+void            tlbsync(void);
+int             uvmkmap(pagetable_t);
+void            uvmkunmap(pagetable_t);
+pagetable_t     kvmcreate(pagetable_t);
+void            kvmuse(struct proc *);
+void            kvmexec(struct proc *);
+
+// copyuser.S
+int             copyuser(void *, void *, uint64);
+int             copyuserstr(char *, char *, uint64);
 
 // plic.c
 void            plicinit(void);
@@ -181,6 +244,8 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(int);
 void            virtio_disk_rw(int, struct buf *, int);
+void            virtio_disk_start(int, struct buf **, int, int);
+void            virtio_disk_wait(int, struct buf **, int);
 void            virtio_disk_intr(int);
 
 // number of elements in fixed-size array
@@ -194,6 +259,13 @@ void           bd_init(void*,void*);
 void           bd_free(void*);
 void           *bd_malloc(uint64);
 
+// slab.c
+struct kcache;
+void            slabinit(void);
+struct kcache*  kcachecreate(char*, uint);
+void*           kcachealloc(struct kcache*);
+void            kcachefree(struct kcache*, void*);
+
 struct list {
   struct list *next;
   struct list *prev;
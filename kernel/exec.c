@@ -3,11 +3,44 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
+#include "fs.h"
+#include "file.h"
 
-static int loadseg(pde_t *pgdir, uint64 addr, struct inode *ip, uint offset, uint sz);
+// exec() loads nothing but the stack. It records the program's
+// loadable segments in p->seg[] and keeps a reference to the
+// program file in p->exe; the first touch of a page of file data
+// faults it in from there (see segfault()). The rest of each
+// segment, its BSS, is zero-filled on first touch like the heap,
+// since it lies below p->sz.
+//
+// So that every page a process faults in is the program it
+// exec()ed, ip->nexec counts the processes running ip, and
+// writei() refuses to write a file while it is non-zero. Nothing
+// truncates a file that is still referenced, as p->exe is.
+// nexec only goes from 0 to 1 in exec(), under ip->lock, so
+// writei() cannot miss it.
+
+// Text cache.
+//
+// An inode that has been exec()ed keeps the whole pages of file
+// data of its first loadable segment in ip->text, as read from
+// the file. segfault() maps them into each process running it
+// read-only and copy-on-write instead of reading a private copy,
+// so they share its text (and its initialized data, until they
+// store to it). The cache holds a reference to each page.
+// Writing the file once no one runs it, or recycling its inode,
+// drops the cache. ip->text is protected by ip->lock.
+
+#define TEXTMAX ((PGSIZE - sizeof(uint64)) / sizeof(uint64))
+
+struct textcache {
+  uint64 off;           // file offset of the cached segment
+  uint64 pa[TEXTMAX];   // the page at off + i*PGSIZE, or 0
+};
 
 
 // 这个函数真的很长...
@@ -17,14 +50,19 @@ int
 exec(char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
-  uint64 argc, sz, sp, ustack[MAXARG+1], stackbase;
+  int i, off, nseg;
+  uint64 argc, sz, sz1, sp, ustack[MAXARG+1], stackbase;
   struct elfhdr elf;                                    // ELF文件头
-  struct inode *ip;
+  struct inode *ip, *exe = 0, *oldexe;
   struct proghdr ph;
+  struct seg seg[NSEG];
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
 
+  // the other threads would be left without their program.
+  if(p->group != p || p->nthread > 0)
+    return -1;
+
   begin_op(ROOTDEV);
 
   // 根据path解析得到inode
@@ -47,8 +85,10 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Note where the program's segments go; they are faulted in
+  // when first touched.
   sz = 0;
+  nseg = 0;
 
   // 遍历elf文件的所有program header，读到ph里面
   // elf里面有多个program header，它们的起始地址是phoff，个数是phnum，是按照数组顺序存放的
@@ -60,20 +100,27 @@ exec(char *path, char **argv)
       continue;
     if(ph.memsz < ph.filesz)
       goto bad;
-    if(ph.vaddr + ph.memsz < ph.vaddr)
-      goto bad;
-    // uvmalloc实际上是让页表从old_sz增加到new_sz，增加的这些分配物理内存
-    if((sz = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz)) == 0)
+    if(ph.vaddr + ph.memsz < ph.vaddr || ph.vaddr + ph.memsz > MAXHEAP)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    // 然后根据program header，把program加载到uvmalloc申请到的地方
-    // 总之就是从elf文件中，把program程序段读到页表的相应地址
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    // 段必须按地址递增、互不重叠，这样每个地址最多属于一个段
+    if(ph.vaddr < sz || nseg >= NSEG)
+      goto bad;
+    if(ph.off + ph.filesz < ph.off || ph.off + ph.filesz > ip->size)
       goto bad;
+    // 不再分配内存和读入文件，只记下这个段，第一次访问的时候再缺页读入
+    seg[nseg].va = ph.vaddr;
+    seg[nseg].off = ph.off;
+    seg[nseg].filesz = ph.filesz;
+    nseg++;
+    sz = ph.vaddr + ph.memsz;
   }
-  iunlockput(ip);
+  // keep the program file, to fault its pages in from.
+  __sync_fetch_and_add(&ip->nexec, 1);
+  iunlock(ip);
   end_op(ROOTDEV);
+  exe = ip;
   ip = 0;
 
   // 此时pagetable就是进程新的页表
@@ -85,8 +132,11 @@ exec(char *path, char **argv)
   // Use the second as the user stack.
   // 这一步是设置好新的页表的栈空间，多分配两页，一页用作stack
   sz = PGROUNDUP(sz);
-  if((sz = uvmalloc(pagetable, sz, sz + 2*PGSIZE)) == 0)
+  if(sz + 2*PGSIZE > MAXHEAP)
     goto bad;
+  if((sz1 = uvmalloc(pagetable, sz, sz + 2*PGSIZE)) == 0)
+    goto bad;
+  sz = sz1;
   uvmclear(pagetable, sz-2*PGSIZE);
   sp = sz;
   stackbase = sp - PGSIZE;
@@ -132,14 +182,27 @@ exec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  // mmap()ed files belong to the old image.
+  vmafree(p);
   // 最后切换当前进程的页表，初始化sz，sp，epc等参数
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
   p->sz = sz;
+  oldexe = p->exe;
+  p->exe = exe;
+  memmove(p->seg, seg, sizeof(seg));
+  p->nseg = nseg;
   p->tf->epc = elf.entry;  // initial program counter = main
   p->tf->sp = sp; // initial stack pointer
+  // the kernel must see the new user memory from here on.
+  kvmexec(p);
   // 最后释放原来的页表
   proc_freepagetable(oldpagetable, oldsz);
+  if(oldexe){
+    begin_op(ROOTDEV);
+    exeput(oldexe);
+    end_op(ROOTDEV);
+  }
   // 最后返回的是argc，也就是exec的第一个参数，也就是exec参数的个数
   // 在syscall中，把这个值赋给a0寄存器，最后从内核重新进入用户态的时候，a0，a1参数分别是argc、argv
   // 然后epc是elf.entry，也就重新进入用户态进程的起始位置开始执行了
@@ -155,33 +218,179 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op(ROOTDEV);
   }
+  if(exe){
+    begin_op(ROOTDEV);
+    exeput(exe);
+    end_op(ROOTDEV);
+  }
   return -1;
 }
 
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
+// Take another reference to ip, the program a process runs,
+// for a child that runs it too.
+struct inode*
+exedup(struct inode *ip)
 {
-  uint i, n;
-  uint64 pa;
-
-  if((va % PGSIZE) != 0)
-    panic("loadseg: va must be page aligned");
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
+  __sync_fetch_and_add(&ip->nexec, 1);
+  return idup(ip);
+}
+
+// Drop a process's reference to the program it ran.
+// Must be called inside a transaction, as for iput().
+void
+exeput(struct inode *ip)
+{
+  __sync_fetch_and_sub(&ip->nexec, 1);
+  iput(ip);
+}
+
+// Return page i of the segment at file offset off from ip's
+// text cache, reading it in if need be, with a reference for
+// the caller. Returns 0 if the page cannot be cached: the cache
+// is for another segment, i is past TEXTMAX, or there is no
+// memory. Caller holds ip->lock.
+static uint64
+textpage(struct inode *ip, uint64 off, uint64 i)
+{
+  struct textcache *t;
+  char *mem;
+
+  if(i >= TEXTMAX)
+    return 0;
+  if(ip->text == 0){
+    if((t = kalloc_zeroed()) == 0)
+      return 0;
+    t->off = off;
+    ip->text = t;
   }
-  
+  t = ip->text;
+  if(t->off != off)
+    return 0;
+  if(t->pa[i] == 0){
+    if((mem = kalloc()) == 0)
+      return 0;
+    if(readi(ip, 0, (uint64)mem, off + i*PGSIZE, PGSIZE) != PGSIZE){
+      kfree(mem);
+      return 0;
+    }
+    t->pa[i] = (uint64)mem;
+  }
+  kref((void*)t->pa[i]);
+  return t->pa[i];
+}
+
+// The segment of g's program whose file data covers va, or 0.
+static struct seg*
+seglookup(struct proc *g, uint64 va)
+{
+  struct seg *s;
+
+  for(s = g->seg; s < &g->seg[g->nseg]; s++)
+    if(va >= s->va && va < s->va + s->filesz)
+      return s;
+  return 0;
+}
+
+// Does [va, va+len) hold any of the file data of g's program?
+// Caller holds g->glock.
+int
+segoverlap(struct proc *g, uint64 va, uint64 len)
+{
+  struct seg *s;
+
+  for(s = g->seg; s < &g->seg[g->nseg]; s++)
+    if(va < s->va + s->filesz && s->va < va + len)
+      return 1;
   return 0;
 }
+
+// Fault in the page of g's program file data containing va:
+// share it from the text cache if it is a whole page there,
+// else read a private copy, zero past the end of the data.
+// Returns the physical address now mapped at va's page,
+// or 0 if va holds no file data or there is no memory.
+uint64
+segfault(struct proc *g, uint64 va)
+{
+  struct inode *ip = g->exe;
+  struct seg *s, seg;
+  char *mem;
+  uint64 pa, end, n;
+  int perm;
+
+  // segments start on page boundaries, so va's page holds file
+  // data if va's page's first byte does.
+  va = PGROUNDDOWN(va);
+  acquire(&g->glock);
+  if((s = seglookup(g, va)) == 0){
+    release(&g->glock);
+    return 0;
+  }
+  seg = *s;   // sbrk() may trim *s once glock is released
+  release(&g->glock);
+
+  ilock(ip);
+  end = seg.va + seg.filesz;
+  perm = PTE_R|PTE_X|PTE_U|PTE_COW;
+  if(va + PGSIZE > end || (pa = textpage(ip, seg.off, (va - seg.va) / PGSIZE)) == 0){
+    perm = PTE_R|PTE_W|PTE_X|PTE_U;
+    n = end - va < PGSIZE ? end - va : PGSIZE;
+    if((mem = kalloc_zeroed()) != 0 &&
+       readi(ip, 0, (uint64)mem, seg.off + (va - seg.va), n) != n){
+      kfree(mem);
+      mem = 0;
+    }
+    pa = (uint64)mem;
+  }
+  iunlock(ip);
+  if(pa == 0)
+    return 0;
+
+  // another thread may have faulted the page in meanwhile,
+  // or given it back with sbrk().
+  acquire(&g->glock);
+  if((end = walkaddr(g->pagetable, va)) != 0){
+    release(&g->glock);
+    kfree((void*)pa);
+    return end;
+  }
+  if(va >= g->sz || mappages(g->pagetable, va, PGSIZE, pa, perm) != 0){
+    release(&g->glock);
+    kfree((void*)pa);
+    return 0;
+  }
+  release(&g->glock);
+  return pa;
+}
+
+// Forget the program file data at and above sz, which sbrk()
+// has given back; it is zero-filled heap if it comes back.
+// Caller holds g->glock.
+void
+segtrim(struct proc *g, uint64 sz)
+{
+  struct seg *s;
+
+  for(s = g->seg; s < &g->seg[g->nseg]; s++){
+    if(s->va >= sz)
+      s->filesz = 0;
+    else if(s->va + s->filesz > sz)
+      s->filesz = sz - s->va;
+  }
+}
+
+// Drop ip's text cache, if it has one. Caller holds ip->lock,
+// or no one else can be using ip.
+void
+textfree(struct inode *ip)
+{
+  struct textcache *t = ip->text;
+
+  if(t == 0)
+    return;
+  ip->text = 0;
+  for(int i = 0; i < TEXTMAX; i++)
+    if(t->pa[i])
+      kfree((void*)t->pa[i]);
+  kfree(t);
+}
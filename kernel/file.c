@@ -14,33 +14,37 @@
 #include "proc.h"
 
 struct devsw devsw[NDEV];
+
+// bytes fileread() and filewrite() copy at a time through the
+// kernel stack, when they cannot copy to or from the user directly.
+#define FBOUNCE 512
+
+// file structs come from a kcache, as many as are open;
+// ftable.lock protects their reference counts.
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
+  struct kcache *cache;
 } ftable;
 
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  ftable.cache = kcachecreate("file", sizeof(struct file));
 }
 
 // Allocate a file structure.
+// Returns 0 if out of memory.
 struct file*
 filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = kcachealloc(ftable.cache)) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -69,9 +73,8 @@ fileclose(struct file *f)
     return;
   }
   ff = *f;
-  f->ref = 0;
-  f->type = FD_NONE;
   release(&ftable.lock);
+  kcachefree(ftable.cache, f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
@@ -101,12 +104,73 @@ filestat(struct file *f, uint64 addr)
   return -1;
 }
 
+// Sequential readahead for a read of f that began at off and
+// has just advanced f->off. While reads follow one another, the
+// window doubles, up to MAXRA blocks, and reads are started for
+// the blocks in the window past f->off that were not started
+// before. A read elsewhere in the file shuts the window.
+// Caller holds f->ip->lock.
+static void
+filereadahead(struct file *f, uint off)
+{
+  uint bn, end;
+
+  if(off != f->ranext){
+    f->rawin = 0;
+    f->raend = 0;
+  } else if(f->rawin == 0){
+    f->rawin = 4;
+  } else if(f->rawin < MAXRA){
+    f->rawin *= 2;
+  }
+  f->ranext = f->off;
+  if(f->rawin == 0)
+    return;
+
+  bn = f->off / BSIZE;
+  end = bn + f->rawin;
+  if(f->raend > bn)
+    bn = f->raend;
+  if(bn < end){
+    ireadahead(f->ip, bn, end - bn);
+    f->raend = end;
+  }
+}
+
+// Read up to n bytes of inode file f at f->off into dst, a
+// user address if user_dst is 1.
+static int
+filereadi(struct file *f, int user_dst, uint64 dst, int n)
+{
+  struct proc *p = myproc();
+  uint off;
+  int r;
+
+  ilock(f->ip);
+  off = f->off;
+  p->nofilefault = user_dst;
+  if((r = readi(f->ip, user_dst, dst, f->off, n)) > 0){
+    f->off += r;
+    filereadahead(f, off);
+  }
+  p->nofilefault = 0;
+  iunlock(f->ip);
+  return r;
+}
+
 // Read from file f.
 // addr is a user virtual address.
+// A fault on addr may have to read another file (the program's
+// own, or an mmap()ed one), and must not wait for that inode's
+// lock while holding f's. So data is copied straight to addr
+// only if its pages are all there, with faults that would read
+// a file made to fail; otherwise it goes through a buffer on the
+// stack, copied out after iunlock().
 int
 fileread(struct file *f, uint64 addr, int n)
 {
-  int r = 0;
+  int r = 0, m, want;
+  char buf[FBOUNCE];
 
   if(f->readable == 0)
     return -1;
@@ -118,10 +182,25 @@ fileread(struct file *f, uint64 addr, int n)
       return -1;
     r = devsw[f->major].read(f, 1, addr, n);
   } else if(f->type == FD_INODE){
-    ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
-      f->off += r;
-    iunlock(f->ip);
+    while(r < n){
+      if(uvmresident(addr + r, n - r)){
+        want = n - r;
+        m = filereadi(f, 1, addr + r, want);
+      } else {
+        want = n - r < FBOUNCE ? n - r : FBOUNCE;
+        m = filereadi(f, 0, (uint64)buf, want);
+        if(m > 0 && copyout(myproc()->pagetable, addr + r, buf, m) < 0)
+          m = -1;
+      }
+      if(m < 0){
+        if(r == 0)
+          r = -1;
+        break;
+      }
+      r += m;
+      if(m < want)
+        break;
+    }
   } else {
     panic("fileread");
   }
@@ -131,10 +210,16 @@ fileread(struct file *f, uint64 addr, int n)
 
 // Write to file f.
 // addr is a user virtual address.
+// As in fileread(), the data is copied straight from addr only
+// if its pages are all there, and otherwise through a buffer on
+// the stack, copied in before the inode is locked.
 int
 filewrite(struct file *f, uint64 addr, int n)
 {
-  int r, ret = 0;
+  int r, ret = 0, user;
+  uint64 src;
+  char buf[FBOUNCE];
+  struct proc *p = myproc();
 
   if(f->writable == 0)
     return -1;
@@ -159,17 +244,28 @@ filewrite(struct file *f, uint64 addr, int n)
       if(n1 > max)
         n1 = max;
 
+      user = uvmresident(addr + i, n1);
+      src = addr + i;
+      if(!user){
+        if(n1 > FBOUNCE)
+          n1 = FBOUNCE;
+        if(copyin(p->pagetable, buf, addr + i, n1) < 0)
+          break;
+        src = (uint64)buf;
+      }
       begin_op(f->ip->dev);
       ilock(f->ip);
-      if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
+      p->nofilefault = user;
+      if ((r = writei(f->ip, user, src, f->off, n1)) > 0)
         f->off += r;
+      p->nofilefault = 0;
       iunlock(f->ip);
       end_op(f->ip->dev);
 
-      if(r < 0)
+      if(r != n1){
+        // error from writei, or the file could not grow
         break;
-      if(r != n1)
-        panic("short filewrite");
+      }
       i += r;
     }
     ret = (i == n ? n : -1);
@@ -6,6 +6,9 @@ struct file {
   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
   uint off;          // FD_INODE and FD_DEVICE
+  uint ranext;       // FD_INODE: offset just past the last read
+  uint raend;        // FD_INODE: block up to which readahead was started
+  int rawin;         // FD_INODE: readahead window, in blocks
   short major;       // FD_DEVICE
   short minor;       // FD_DEVICE
 };
@@ -19,6 +22,7 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *next; // icache list
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -27,7 +31,9 @@ struct inode {
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  uint addrs[NDIRECT+2];
+  struct textcache *text; // pages exec() shares, see exec.c
+  int nexec;          // processes running it (atomic); see exec.c
 };
 
 // map major device number to device functions.
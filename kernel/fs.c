@@ -86,6 +86,63 @@ balloc(uint dev)
   panic("balloc: out of blocks");
 }
 
+// Allocate disk block b, zeroed, if it is free.
+// Returns b, or 0 if b is in use.
+static uint
+ballocat(uint dev, uint b)
+{
+  struct buf *bp;
+  int bi, m;
+
+  if(b >= sb.size)
+    return 0;
+  bp = bread(dev, BBLOCK(b, sb));
+  bi = b % BPB;
+  m = 1 << (bi % 8);
+  if(bp->data[bi/8] & m){
+    brelse(bp);
+    return 0;
+  }
+  bp->data[bi/8] |= m;
+  log_write(bp);
+  brelse(bp);
+  bzero(dev, b);
+  return b;
+}
+
+#define EXTSLACK 512  // blocks left for an extent to grow into
+
+// Allocate a zeroed disk block to start a new extent. It is put
+// EXTSLACK blocks into the first run of 2*EXTSLACK free blocks,
+// so that both the new extent and the file that ends just before
+// the run (if any) have room to keep growing in place.
+static uint
+ballocrun(uint dev)
+{
+  int b, bi, run;
+  uint addr;
+  struct buf *bp;
+
+  run = 0;
+  for(b = 0; b < sb.size; b += BPB){
+    bp = bread(dev, BBLOCK(b, sb));
+    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
+      if(bp->data[bi/8] & (1 << (bi % 8))){
+        run = 0;
+      } else if(++run == 2*EXTSLACK){
+        brelse(bp);
+        // the block may have been taken since we looked.
+        if((addr = ballocat(dev, b + bi + 1 - EXTSLACK)) != 0)
+          return addr;
+        return balloc(dev);
+      }
+    }
+    brelse(bp);
+  }
+  // no long runs left; take any free block.
+  return balloc(dev);
+}
+
 // Free a disk block.
 static void
 bfree(int dev, uint b)
@@ -171,21 +228,24 @@ bfree(int dev, uint b)
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
+//
+// The in-memory inodes come from a kcache and are linked
+// through ip->next. iget() adds new ones until there are
+// NINODE, and after that only when every one is in use;
+// otherwise it recycles one with ref 0.
 
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode *head;
+  int n;
+  struct kcache *cache;
 } icache;
 
 void
 iinit()
 {
-  int i = 0;
-  
   initlock(&icache.lock, "icache");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&icache.inode[i].lock, "inode");
-  }
+  icache.cache = kcachecreate("inode", sizeof(struct inode));
 }
 
 static struct inode* iget(uint dev, uint inum);
@@ -247,10 +307,12 @@ iget(uint dev, uint inum)
 
   acquire(&icache.lock);
 
-  // Is the inode already cached?
+  // Is the inode already cached? An entry with ref 0 is
+  // still good until it is recycled: its contents are reread
+  // if !valid, and it keeps its text cache for exec().
   empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
+  for(ip = icache.head; ip; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
       ip->ref++;
       release(&icache.lock);
       return ip;
@@ -259,11 +321,24 @@ iget(uint dev, uint inum)
       empty = ip;
   }
 
-  // Recycle an inode cache entry.
-  if(empty == 0)
-    panic("iget: no inodes");
+  // Add an inode cache entry, or recycle one.
+  ip = 0;
+  if(empty == 0 || icache.n < NINODE){
+    if((ip = kcachealloc(icache.cache)) != 0){
+      memset(ip, 0, sizeof(*ip));
+      initobjsleeplock(&ip->lock, "inode");
+      ip->next = icache.head;
+      icache.head = ip;
+      icache.n++;
+    }
+  }
+  if(ip == 0){
+    if((ip = empty) == 0)
+      panic("iget: no inodes");
+    // no one holds empty, so its text cache can go.
+    textfree(ip);
+  }
 
-  ip = empty;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
@@ -371,15 +446,121 @@ iunlockput(struct inode *ip)
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT]. The last NDINDIRECT
+// blocks are reached through the doubly-indirect block
+// ip->addrs[NDIRECT+1], which lists NINDIRECT indirect blocks.
+//
+// If mkfs built the file system with FS_EXTENT, ip->addrs[]
+// instead holds extents, each a run of consecutive disk blocks,
+// and new blocks are placed to keep those runs long.
+
+// Return entry bn of the indirect block addr, allocating
+// the data block it names if necessary.
+static uint
+bmapind(uint dev, uint addr, uint bn)
+{
+  uint *a;
+  struct buf *bp;
+
+  bp = bread(dev, addr);
+  a = (uint*)bp->data;
+  if((addr = a[bn]) == 0){
+    a[bn] = addr = balloc(dev);
+    log_write(bp);
+  }
+  brelse(bp);
+  return addr;
+}
+
+// Find block bn among the extents e[0..n-1], subtracting the
+// lengths of the extents it skips from *bn. If bn lies just past
+// the last extent, allocate it: grow *last (the file's last
+// extent so far) if the next disk block is free, else start a
+// new extent in the first unused slot, and set *alloc. Returns
+// the disk block, or 0 if bn is past the last extent and e[] is full.
+static uint
+bmapext(uint dev, struct extent *e, int n, uint *bn, struct extent **last,
+        int *alloc)
+{
+  struct extent *x;
+  uint addr;
+
+  for(x = e; x < &e[n] && x->len; x++){
+    if(*bn < x->len)
+      return x->start + *bn;
+    *bn -= x->len;
+    *last = x;
+  }
+  if(*bn != 0){
+    // files have no holes, so bn must be further on, past e[].
+    if(x < &e[n])
+      panic("bmapext");
+    return 0;
+  }
+  if(*last && (addr = ballocat(dev, (*last)->start + (*last)->len)) != 0){
+    (*last)->len++;
+    *alloc = 1;
+    return addr;
+  }
+  if(x == &e[n])
+    return 0;
+  x->start = addr = ballocrun(dev);
+  x->len = 1;
+  *alloc = 1;
+  return addr;
+}
+
+// bmap() for an extent-mapped inode. The first NEXTENT extents
+// are in ip->addrs[], so most lookups read no other block.
+static uint
+ebmap(struct inode *ip, uint bn)
+{
+  struct extent *last;
+  struct buf *bp;
+  uint addr;
+  int alloc;
+
+  last = 0;
+  alloc = 0;
+  addr = bmapext(ip->dev, (struct extent*)ip->addrs, NEXTENT, &bn, &last, &alloc);
+  if(addr != 0)
+    return addr;
+
+  // Load the extent block, allocating if necessary.
+  if((addr = ip->addrs[NDIRECT+1]) == 0)
+    ip->addrs[NDIRECT+1] = addr = balloc(ip->dev);
+  bp = bread(ip->dev, addr);
+  addr = bmapext(ip->dev, (struct extent*)bp->data, NXEXTENT, &bn, &last, &alloc);
+  if(alloc)
+    log_write(bp);
+  brelse(bp);
+  return addr;
+}
+
+// Free the blocks of extents e[0..n-1] and clear them.
+static void
+itruncext(uint dev, struct extent *e, int n)
+{
+  struct extent *x;
+  uint i;
+
+  for(x = e; x < &e[n] && x->len; x++){
+    for(i = 0; i < x->len; i++)
+      bfree(dev, x->start + i);
+    x->start = x->len = 0;
+  }
+}
 
 // Return the disk block address of the nth block in inode ip.
 // If there is no such block, bmap allocates one.
+// Returns 0 if an extent-mapped inode has run out of extents.
 static uint
 bmap(struct inode *ip, uint bn)
 {
-  uint addr, *a;
-  struct buf *bp;
+  uint addr;
+
+  if(sb.features & FS_EXTENT)
+    return ebmap(ip, bn);
 
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0)
@@ -392,19 +573,47 @@ bmap(struct inode *ip, uint bn)
     // Load indirect block, allocating if necessary.
     if((addr = ip->addrs[NDIRECT]) == 0)
       ip->addrs[NDIRECT] = addr = balloc(ip->dev);
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
-      log_write(bp);
-    }
-    brelse(bp);
-    return addr;
+    return bmapind(ip->dev, addr, bn);
+  }
+  bn -= NINDIRECT;
+
+  if(bn < NDINDIRECT){
+    // Load the doubly-indirect block, then the indirect
+    // block it points to, allocating either if necessary.
+    if((addr = ip->addrs[NDIRECT+1]) == 0)
+      ip->addrs[NDIRECT+1] = addr = balloc(ip->dev);
+    addr = bmapind(ip->dev, addr, bn / NINDIRECT);
+    return bmapind(ip->dev, addr, bn % NINDIRECT);
   }
 
   panic("bmap: out of range");
 }
 
+// Free the indirect block addr and every data block it lists.
+// With depth 2, addr is a doubly-indirect block whose entries
+// are themselves indirect blocks.
+static void
+itruncind(uint dev, uint addr, int depth)
+{
+  struct buf *bp;
+  uint b;
+
+  for(int j = 0; j < NINDIRECT; j++){
+    // don't hold addr while locking the blocks it lists, which
+    // may have lower block numbers; see install_trans().
+    bp = bread(dev, addr);
+    b = ((uint*)bp->data)[j];
+    brelse(bp);
+    if(b == 0)
+      continue;
+    if(depth > 1)
+      itruncind(dev, b, depth - 1);
+    else
+      bfree(dev, b);
+  }
+  bfree(dev, addr);
+}
+
 // Truncate inode (discard contents).
 // Only called when the inode has no links
 // to it (no directory entries referring to it)
@@ -413,9 +622,23 @@ bmap(struct inode *ip, uint bn)
 static void
 itrunc(struct inode *ip)
 {
-  int i, j;
   struct buf *bp;
-  uint *a;
+  int i;
+
+  textfree(ip);
+  if(sb.features & FS_EXTENT){
+    itruncext(ip->dev, (struct extent*)ip->addrs, NEXTENT);
+    if(ip->addrs[NDIRECT+1]){
+      bp = bread(ip->dev, ip->addrs[NDIRECT+1]);
+      itruncext(ip->dev, (struct extent*)bp->data, NXEXTENT);
+      brelse(bp);
+      bfree(ip->dev, ip->addrs[NDIRECT+1]);
+      ip->addrs[NDIRECT+1] = 0;
+    }
+    ip->size = 0;
+    iupdate(ip);
+    return;
+  }
 
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
@@ -425,21 +648,39 @@ itrunc(struct inode *ip)
   }
 
   if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
-    }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
+    itruncind(ip->dev, ip->addrs[NDIRECT], 1);
     ip->addrs[NDIRECT] = 0;
   }
 
+  if(ip->addrs[NDIRECT+1]){
+    itruncind(ip->dev, ip->addrs[NDIRECT+1], 2);
+    ip->addrs[NDIRECT+1] = 0;
+  }
+
   ip->size = 0;
   iupdate(ip);
 }
 
+// Start reading blocks bn..bn+n-1 of ip into the buffer cache,
+// without waiting, stopping at the end of the file.
+// Caller must hold ip->lock.
+void
+ireadahead(struct inode *ip, uint bn, int n)
+{
+  uint addrs[MAXRA];
+  uint nblocks;
+  int i;
+
+  if(n > MAXRA)
+    n = MAXRA;
+  nblocks = (ip->size + BSIZE - 1) / BSIZE;
+  // blocks before the end of the file are all allocated,
+  // so bmap() only looks them up.
+  for(i = 0; i < n && bn + i < nblocks; i++)
+    addrs[i] = bmap(ip, bn + i);
+  breadahead(ip->dev, addrs, i);
+}
+
 // Copy stat information from inode.
 // Caller must hold ip->lock.
 void
@@ -456,6 +697,9 @@ stati(struct inode *ip, struct stat *st)
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
 // otherwise, dst is a kernel address.
+// Returns the number of bytes read, which is short at the end
+// of the file or if the copy to dst fails; -1 if it failed at
+// once.
 int
 readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
@@ -468,11 +712,11 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     n = ip->size - off;
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
+    bp = bread(ip->dev, bmap(ip, off/BSIZE));
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
       brelse(bp);
-      break;
+      return tot > 0 ? tot : -1;
     }
     brelse(bp);
   }
@@ -487,16 +731,25 @@ int
 writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 {
   uint tot, m;
+  uint addr;
   struct buf *bp;
 
   if(off > ip->size || off + n < off)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     return -1;
+  // running programs fault their pages in from the file.
+  if(ip->nexec > 0)
+    return -1;
+  // programs exec()ed from now on must see the new contents.
+  if(n > 0)
+    textfree(ip);
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
+    if((addr = bmap(ip, off/BSIZE)) == 0)
+      break;
+    bp = bread(ip->dev, addr);
     if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
       brelse(bp);
       break;
@@ -514,7 +767,7 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
     iupdate(ip);
   }
 
-  return n;
+  return tot;
 }
 
 // Directories
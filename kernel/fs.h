@@ -20,13 +20,17 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint features;     // FS_* flags
 };
 
 #define FSMAGIC 0x10203040
 
-#define NDIRECT 12
+#define FS_EXTENT 0x1    // inodes map their blocks with extents
+
+#define NDIRECT 11
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NDINDIRECT (NINDIRECT * NINDIRECT)
+#define MAXFILE (NDIRECT + NINDIRECT + NDINDIRECT)
 
 // On-disk inode structure
 struct dinode {
@@ -35,9 +39,20 @@ struct dinode {
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  uint addrs[NDIRECT+2];   // Data block addresses
+};
+
+// On a FS_EXTENT file system, addrs[] instead holds NEXTENT
+// runs of disk blocks, in file order. Further runs spill into
+// the extent block addrs[NDIRECT+1], which holds NXEXTENT.
+struct extent {
+  uint start;   // first disk block of the run
+  uint len;     // number of blocks; 0 if the slot is unused
 };
 
+#define NEXTENT ((NDIRECT+1) / 2)
+#define NXEXTENT (BSIZE / sizeof(struct extent))
+
 // Inodes per block.
 #define IPB           (BSIZE / sizeof(struct dinode))
 
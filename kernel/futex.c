@@ -0,0 +1,107 @@
+//
+// Futexes: user-space locks and condition variables sleep and
+// wake in the kernel only when they must, keyed by the address
+// of an int in user memory.
+//
+// A waiter sleeps on the physical address of the int, so that
+// threads sharing a page table, or processes sharing a page
+// through mmap(MAP_SHARED), meet on the same channel, which
+// sleep()/wakeup() hash to a short sleep queue. The check of
+// *addr and the sleep happen under the channel's futex lock,
+// which FUTEX_WAKE also takes, so a wakeup cannot slip in
+// between them.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "futex.h"
+
+#define NFUTEXLOCK 13
+
+struct spinlock futexlock[NFUTEXLOCK];
+
+void
+futexinit(void)
+{
+  for(int i = 0; i < NFUTEXLOCK; i++)
+    initlock(&futexlock[i], "futex");
+}
+
+static struct spinlock*
+futexhash(uint64 pa)
+{
+  return &futexlock[(pa >> 2) % NFUTEXLOCK];
+}
+
+// Physical address of the int at user address addr, made
+// private and writable first if it is copy-on-write, so that
+// a later store will not move it to another page. Returns 0
+// if addr is not a valid, aligned user address.
+static uint64
+futexaddr(struct proc *p, uint64 addr)
+{
+  uint64 va = PGROUNDDOWN(addr);
+  uint64 pa;
+
+  if(addr % sizeof(int) != 0 || addr >= MAXVA)
+    return 0;
+  if((pa = vmfault(p->pagetable, va, PTE_W)) == 0)
+    return 0;
+  return pa + (addr - va);
+}
+
+// Sleep until woken by futexwake(addr) if the int at addr
+// still holds val. Returns 0 when woken, which may be spurious,
+// or -1 if *addr != val or the process is killed.
+int
+futexwait(uint64 addr, int val)
+{
+  struct proc *p = myproc();
+  struct proc *g = p->group;
+  struct spinlock *lk;
+  uint64 pa;
+  int cur;
+
+  if((pa = futexaddr(p, addr)) == 0)
+    return -1;
+  lk = futexhash(pa);
+  acquire(lk);
+  // another thread may have unmapped the page since futexaddr(),
+  // and it may have been freed; read it only while g->glock
+  // keeps it mapped at addr.
+  acquire(&g->glock);
+  if(walkaddr(g->pagetable, addr) + (addr - PGROUNDDOWN(addr)) != pa){
+    release(&g->glock);
+    release(lk);
+    return -1;
+  }
+  cur = *(int*)pa;
+  release(&g->glock);
+  if(cur != val || p->killed){
+    release(lk);
+    return -1;
+  }
+  sleep((void*)pa, lk);
+  release(lk);
+  return 0;
+}
+
+// Wake all processes sleeping in futexwait() on addr.
+int
+futexwake(uint64 addr)
+{
+  struct spinlock *lk;
+  uint64 pa;
+
+  if((pa = futexaddr(myproc(), addr)) == 0)
+    return -1;
+  lk = futexhash(pa);
+  acquire(lk);
+  wakeup((void*)pa);
+  release(lk);
+  return 0;
+}
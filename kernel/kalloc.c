@@ -1,6 +1,29 @@
 // Physical memory allocator, for user processes,
-// kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// kernel stacks, and page-table pages.
+// Allocates whole 4096-byte pages.
+//
+// Each CPU keeps its own free list so that the common
+// kalloc()/kfree() path only touches a lock no other CPU
+// is using. Pages move between the per-CPU lists and a
+// shared pool in batches of KBATCH; a CPU whose list and
+// the shared pool are both empty steals a batch from
+// another CPU.
+//
+// Memory that is whole, aligned 2MB superpages at boot is kept
+// on a list of its own, so that it can back superpage mappings
+// (see uvmalloc() and vmfault()). When the 4096-byte lists run
+// dry, a superpage is split up to refill them; the pieces are
+// never put back together.
+//
+// A CPU with nothing to run zeroes free pages, one at a time,
+// into kzero, a single pool shared by all CPUs under one lock
+// (kzerofill(), called from scheduler()), so that kalloc_zeroed()
+// usually need not clear the page it returns. Pages in the pool
+// are still free memory: kalloc() takes them when everything
+// else is gone.
+//
+// Build with KJUNK defined (make KJUNK=1) to fill pages with
+// junk as they are freed and allocated.
 
 #include "types.h"
 #include "param.h"
@@ -14,24 +37,51 @@ void freerange(void *pa_start, void *pa_end);
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
+#define KBATCH  32          // pages moved per refill/drain
+#define KHIWAT  (4*KBATCH)  // drain a per-CPU list above this
+#define KZERO   256         // pages kzerofill() keeps zeroed
+
 struct run {
   struct run *next;
 };
 
-// 整个系统管理的物理内存
-struct {
+// 一个空闲链表，全局的pool和每个CPU各有一个
+struct kmem {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  int nfree;
+};
+
+// 整个系统管理的物理内存
+struct kmem kmem;           // shared pool
+struct kmem kcpu[NCPU];     // per-CPU free lists
+struct kmem ksuper;         // free superpages
+struct kmem kzero;          // free pages, already zeroed
+
+// Reference counts for physical pages, indexed by page number
+// above KERNBASE. A page shared copy-on-write by several page
+// tables goes back on a free list only when kfree() drops the
+// last reference. Updated with atomic adds, so no lock.
+#define PA2REF(pa) (pageref[((uint64)(pa) - KERNBASE) / PGSIZE])
+static int pageref[(PHYSTOP - KERNBASE) / PGSIZE];
+
+static char *kcpu_names[NCPU] = {
+  "kmem0", "kmem1", "kmem2", "kmem3", "kmem4", "kmem5", "kmem6", "kmem7",
+};
 
 void
 kinit()
 {
   initlock(&kmem.lock, "kmem");
+  initlock(&ksuper.lock, "ksuper");
+  initlock(&kzero.lock, "kzero");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kcpu[i].lock, kcpu_names[i]);
   // 初始化[end, PHYSTOP]之间的物理内存
   // 根据kernel.ld中的指示，end是kernel之后的第一个地址
   // 注意end是链接脚本中导出的符号，
-  freerange(end, (void*)PHYSTOP);
+  freerange(end, (void*)(PHYSTOP - BDSIZE));
+  slabinit();
 }
 
 void
@@ -41,33 +91,137 @@ freerange(void *pa_start, void *pa_end)
   // 对[pa_start, pa_end]中间的所有页面，调用kfree()初始化页面
   // 地址p是对PGSIZE对齐的
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE){
+    PA2REF(p) = 1;
+    if((uint64)p % SUPERPGSIZE == 0 && p + SUPERPGSIZE <= (char*)pa_end){
+      ksuperfree(p);
+      p += SUPERPGSIZE - PGSIZE;
+    } else {
+      kfree(p);
+    }
+  }
+}
+
+// Move up to n pages from the head of src to the head of dst.
+// Caller holds both locks. Returns the number of pages moved.
+static int
+kmove(struct kmem *dst, struct kmem *src, int n)
+{
+  struct run *first, *last;
+  int i;
+
+  if((first = src->freelist) == 0)
+    return 0;
+  last = first;
+  for(i = 1; i < n && last->next; i++)
+    last = last->next;
+  src->freelist = last->next;
+  src->nfree -= i;
+  last->next = dst->freelist;
+  dst->freelist = first;
+  dst->nfree += i;
+  return i;
 }
 
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Refill c's empty free list, first from the shared pool
+// and then by stealing from the other CPUs.
+// Caller holds c->lock, and interrupts are off.
+static void
+krefill(struct kmem *c)
+{
+  struct run *r;
+
+  acquire(&kmem.lock);
+  kmove(c, &kmem, KBATCH);
+  release(&kmem.lock);
+  if(c->freelist)
+    return;
+
+  // 共享池空了，先拆一个大页给本CPU
+  acquire(&ksuper.lock);
+  if((r = ksuper.freelist) != 0){
+    ksuper.freelist = r->next;
+    ksuper.nfree--;
+  }
+  release(&ksuper.lock);
+  if(r){
+    for(int i = SUPERPGSIZE/PGSIZE - 1; i >= 0; i--){
+      struct run *pg = (struct run*)((char*)r + i*PGSIZE);
+      pg->next = c->freelist;
+      c->freelist = pg;
+    }
+    c->nfree += SUPERPGSIZE/PGSIZE;
+    return;
+  }
+
+  // 共享池也空了，去其他CPU那里偷一批。
+  // 锁的顺序总是按照kcpu[]的下标，避免两个CPU互相偷的时候死锁。
+  for(struct kmem *v = kcpu; v < &kcpu[NCPU] && c->freelist == 0; v++){
+    if(v == c || v->freelist == 0)
+      continue;
+    if(v < c){
+      release(&c->lock);
+      acquire(&v->lock);
+      acquire(&c->lock);
+    } else {
+      acquire(&v->lock);
+    }
+    if(c->freelist == 0)
+      kmove(c, v, (v->nfree + 1) / 2);
+    release(&v->lock);
+  }
+  if(c->freelist)
+    return;
+
+  // 最后才动已经清零的页面
+  acquire(&kzero.lock);
+  kmove(c, &kzero, KBATCH);
+  release(&kzero.lock);
+}
+
+// Drop a reference to the page of physical memory pointed
+// at by v, which normally should have been returned by a
+// call to kalloc(), and free it if that was the last one.
+// (The exception is when initializing the allocator; see
+// kinit above.)
 void
 kfree(void *pa)
 {
   struct run *r;
+  struct kmem *c;
+  int ref;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  if((ref = __sync_sub_and_fetch(&PA2REF(pa), 1)) > 0)
+    return;
+  if(ref < 0)
+    panic("kfree: ref");
+
+#ifdef KJUNK
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
+#endif
 
   // 把这个4KB的页面类型转换为sturct run*
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  // 然后插入到空闲链表的头部
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  c = &kcpu[cpuid()];
+  acquire(&c->lock);
+  // 然后插入到本CPU空闲链表的头部
+  r->next = c->freelist;
+  c->freelist = r;
+  c->nfree++;
+  if(c->nfree > KHIWAT){
+    // 本CPU的空闲页面太多了，还一批给共享池
+    acquire(&kmem.lock);
+    kmove(&kmem, c, KBATCH);
+    release(&kmem.lock);
+  }
+  release(&c->lock);
+  pop_off();
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -77,14 +231,157 @@ void *
 kalloc(void)
 {
   struct run *r;
+  struct kmem *c;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  push_off();
+  c = &kcpu[cpuid()];
+  acquire(&c->lock);
+  if(c->freelist == 0)
+    krefill(c);
+  r = c->freelist;
+  if(r){
+    c->freelist = r->next;
+    c->nfree--;
+  }
+  release(&c->lock);
+  pop_off();
 
-  if(r)
+  if(r){
+    PA2REF(r) = 1;
+#ifdef KJUNK
     memset((char*)r, 5, PGSIZE); // fill with junk
+#endif
+  }
+  return (void*)r;
+}
+
+// Allocate one 4096-byte page of zeroed physical memory,
+// from the zeroed pool if it has any.
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_zeroed(void)
+{
+  struct run *r;
+
+  acquire(&kzero.lock);
+  if((r = kzero.freelist) != 0){
+    kzero.freelist = r->next;
+    kzero.nfree--;
+  }
+  release(&kzero.lock);
+  if(r){
+    r->next = 0;  // the only word the pool dirtied
+    PA2REF(r) = 1;
+    return (void*)r;
+  }
+  if((r = kalloc()) != 0)
+    memset((char*)r, 0, PGSIZE);
   return (void*)r;
 }
+
+// Zero one free page of this CPU's, or of the shared pool, and
+// put it in the zeroed pool, unless the pool is full. Called by
+// scheduler() when this CPU has nothing to run, with interrupts
+// off. Returns 1 if it zeroed a page, 0 if there was nothing to do.
+int
+kzerofill(void)
+{
+  struct run *r;
+  struct kmem *c;
+
+  if(kzero.nfree >= KZERO)   // racy peek; no harm if wrong
+    return 0;
+
+  // don't split superpages or steal from other CPUs for this.
+  c = &kcpu[cpuid()];
+  acquire(&c->lock);
+  if(c->freelist == 0){
+    acquire(&kmem.lock);
+    kmove(c, &kmem, KBATCH);
+    release(&kmem.lock);
+  }
+  if((r = c->freelist) != 0){
+    c->freelist = r->next;
+    c->nfree--;
+  }
+  release(&c->lock);
+  if(r == 0)
+    return 0;
+
+  memset((char*)r, 0, PGSIZE);
+  acquire(&kzero.lock);
+  r->next = kzero.freelist;
+  kzero.freelist = r;
+  kzero.nfree++;
+  release(&kzero.lock);
+  return 1;
+}
+
+// Add a reference to an allocated page, e.g. when fork()
+// shares it copy-on-write with a child.
+void
+kref(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kref");
+  if(__sync_fetch_and_add(&PA2REF(pa), 1) < 1)
+    panic("kref: free page");
+}
+
+// Number of references to an allocated page.
+int
+krefcount(void *pa)
+{
+  return PA2REF(pa);
+}
+
+// Allocate one 2MB superpage of physical memory, aligned to
+// its size. Returns 0 if there is no whole superpage left.
+// Never fills it with junk, even with KJUNK; callers
+// zero it anyway, and 2MB is a lot to fill twice.
+void *
+ksuperalloc(void)
+{
+  struct run *r;
+
+  acquire(&ksuper.lock);
+  if((r = ksuper.freelist) != 0){
+    ksuper.freelist = r->next;
+    ksuper.nfree--;
+  }
+  release(&ksuper.lock);
+  if(r)
+    PA2REF(r) = 1;
+  return (void*)r;
+}
+
+// Free a superpage returned by ksuperalloc().
+// Superpages are never shared, so there is only one reference.
+void
+ksuperfree(void *pa)
+{
+  struct run *r = (struct run*)pa;
+
+  if(((uint64)pa % SUPERPGSIZE) != 0 || (char*)pa < end || (uint64)pa + SUPERPGSIZE > PHYSTOP)
+    panic("ksuperfree");
+  if(__sync_sub_and_fetch(&PA2REF(pa), 1) != 0)
+    panic("ksuperfree: ref");
+
+  acquire(&ksuper.lock);
+  r->next = ksuper.freelist;
+  ksuper.freelist = r;
+  ksuper.nfree++;
+  release(&ksuper.lock);
+}
+
+// Turn an allocated superpage into 512 allocated pages, each
+// to be freed on its own with kfree(), e.g. when only part of
+// a superpage mapping is unmapped.
+void
+ksplit(void *pa)
+{
+  if(((uint64)pa % SUPERPGSIZE) != 0 || PA2REF(pa) != 1)
+    panic("ksplit");
+  for(uint64 off = PGSIZE; off < SUPERPGSIZE; off += PGSIZE)
+    PA2REF((char*)pa + off) = 1;
+}
@@ -11,8 +11,8 @@
 //
 // A log transaction contains the updates of multiple FS system
 // calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
-// any reasoning required about whether a commit might
+// no FS system calls active in that transaction. Thus there is
+// never any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
@@ -21,9 +21,17 @@
 // But if it thinks the log is close to running out, it
 // sleeps until the last outstanding end_op() commits.
 //
+// The log is double-buffered: the on-disk log holds two regions,
+// and while one transaction is being written to its region and
+// installed, the next transaction is open in the other region,
+// so system calls need not wait for the disk. Only the short
+// copy of the closed transaction's blocks into the log buffers
+// holds them up.
+//
 // The log is a physical re-do log containing disk blocks.
-// The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
+// The on-disk format of each region:
+//   header block, containing a sequence number and
+//     block #s for block A, B, C, ...
 //   block A
 //   block B
 //   block C
@@ -34,17 +42,20 @@
 // and to keep track in memory of logged block# before commit.
 struct logheader {
   int n;
+  uint seq;   // transactions commit in seq order
   int block[LOGSIZE];
 };
 
 struct log {
   struct spinlock lock;
   int start;
-  int size;
+  int size;        // blocks in each region, including its header
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int committing;  // in commit(), please wait to commit.
+  int closing;     // commit() is copying out a transaction; please wait.
   int dev;
-  struct logheader lh;
+  int cur;         // region of the open transaction
+  struct logheader lh[2];  // one per region
 };
 struct log log[NDISK];
 
@@ -59,66 +70,154 @@ initlog(int dev, struct superblock *sb)
 
   initlock(&log[dev].lock, "log");
   log[dev].start = sb->logstart;
-  log[dev].size = sb->nlog;
+  log[dev].size = sb->nlog / 2;
+  if(log[dev].size - 1 > LOGSIZE)
+    log[dev].size = LOGSIZE + 1;
   log[dev].dev = dev;
   recover_from_log(dev);
 }
 
-// Copy committed blocks from log to their home location
+// First block of log region r.
+static int
+regionstart(int dev, int r)
+{
+  return log[dev].start + r * log[dev].size;
+}
+
+// Is blockno in transaction lh? Caller holds the log lock.
+static int
+inlog(struct logheader *lh, uint blockno)
+{
+  for (int i = 0; i < lh->n; i++) {
+    if (lh->block[i] == blockno)
+      return 1;
+  }
+  return 0;
+}
+
+// Write locked, pinned bufs b[0..n-1] home, as one batch, and
+// let them go.
 static void
-install_trans(int dev)
+installv(struct buf **b, int n)
 {
-  int tail;
+  bwritev(b, n);
+  for (int i = 0; i < n; i++) {
+    bunpin(b[i]);
+    brelse(b[i]);
+  }
+}
 
-  for (tail = 0; tail < log[dev].lh.n; tail++) {
-    struct buf *lbuf = bread(dev, log[dev].start+tail+1); // read log block
-    struct buf *dbuf = bread(dev, log[dev].lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+// Write the committed blocks of region r to their home locations,
+// from the buffer cache, where they are pinned. A block that the
+// open transaction has since modified is skipped, since that
+// transaction will write it again; region r's header stays on
+// disk until then, so recovery can still replay it.
+//
+// FS calls in the open transaction may hold one block while they
+// lock another, in any order (bmap() holds an indirect block
+// while balloc() zeroes a new one), so this never waits for a
+// block while holding others: blocks whose locks are free are
+// gathered into a batch, and the batch is written out before
+// waiting for a busy one.
+static void
+install_trans(int dev, int r)
+{
+  struct logheader *lh = &log[dev].lh[r];
+  struct buf *dbuf[LOGSIZE];
+  struct buf *b;
+  int tail, n;
+
+  n = 0;
+  for (tail = 0; tail < lh->n; tail++) {
+    if ((b = btryread(dev, lh->block[tail])) == 0) {
+      installv(dbuf, n);
+      n = 0;
+      b = bread(dev, lh->block[tail]);
+    }
+    // holding b's lock, so no FS call is midway between
+    // modifying it and calling log_write().
+    acquire(&log[dev].lock);
+    if(inlog(&log[dev].lh[log[dev].cur], b->blockno)){
+      release(&log[dev].lock);
+      bunpin(b);
+      brelse(b);
+      continue;
+    }
+    release(&log[dev].lock);
+    dbuf[n++] = b;
   }
+  installv(dbuf, n);  // write dst to disk, all at once
 }
 
-// Read the log header from disk into the in-memory log header
+// Read region r's log header from disk into lh.
 static void
-read_head(int dev)
+read_head(int dev, int r, struct logheader *lh)
 {
-  struct buf *buf = bread(dev, log[dev].start);
-  struct logheader *lh = (struct logheader *) (buf->data);
+  struct buf *buf = bread(dev, regionstart(dev, r));
+  struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  log[dev].lh.n = lh->n;
-  for (i = 0; i < log[dev].lh.n; i++) {
-    log[dev].lh.block[i] = lh->block[i];
+  lh->n = hb->n;
+  lh->seq = hb->seq;
+  for (i = 0; i < lh->n; i++) {
+    lh->block[i] = hb->block[i];
   }
   brelse(buf);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Write lh to region r's header block on disk.
+// This is the true point at which a transaction commits.
 static void
-write_head(int dev)
+write_head(int dev, int r, struct logheader *lh)
 {
-  struct buf *buf = bread(dev, log[dev].start);
+  struct buf *buf = bclaim(dev, regionstart(dev, r));
   struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  hb->n = log[dev].lh.n;
-  for (i = 0; i < log[dev].lh.n; i++) {
-    hb->block[i] = log[dev].lh.block[i];
+  memset(buf->data, 0, BSIZE);
+  hb->n = lh->n;
+  hb->seq = lh->seq;
+  for (i = 0; i < lh->n; i++) {
+    hb->block[i] = lh->block[i];
   }
   bwrite(buf);
   brelse(buf);
 }
 
+// Copy committed blocks of lh from log region r to their home location
+static void
+replay(int dev, int r, struct logheader *lh)
+{
+  int tail;
+
+  for (tail = 0; tail < lh->n; tail++) {
+    struct buf *lbuf = bread(dev, regionstart(dev, r)+tail+1); // read log block
+    struct buf *dbuf = bread(dev, lh->block[tail]); // read dst
+    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
+    bwrite(dbuf);  // write dst to disk
+    brelse(lbuf);
+    brelse(dbuf);
+  }
+}
+
 static void
 recover_from_log(int dev)
 {
-  read_head(dev);
-  install_trans(dev); // if committed, copy from log to disk
-  log[dev].lh.n = 0;
-  write_head(dev); // clear the log
+  struct logheader *lh = log[dev].lh;
+  int first;
+
+  read_head(dev, 0, &lh[0]);
+  read_head(dev, 1, &lh[1]);
+  // both regions may hold committed transactions; the older one
+  // must be installed first.
+  first = (int)(lh[1].seq - lh[0].seq) < 0;
+  replay(dev, first, &lh[first]);   // if committed, copy from log to disk
+  replay(dev, !first, &lh[!first]);
+
+  log[dev].cur = !first;
+  log[dev].lh[first].n = 0;
+  log[dev].lh[!first].n = 0;
+  log[dev].lh[!first].seq += 1;
+  write_head(dev, 0, &log[dev].lh[0]); // clear the log
+  write_head(dev, 1, &log[dev].lh[1]);
 }
 
 // called at the start of each FS system call.
@@ -127,9 +226,9 @@ begin_op(int dev)
 {
   acquire(&log[dev].lock);
   while(1){
-    if(log[dev].committing){
+    if(log[dev].closing){
       sleep(&log, &log[dev].lock);
-    } else if(log[dev].lh.n + (log[dev].outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(log[dev].lh[log[dev].cur].n + (log[dev].outstanding+1)*MAXOPBLOCKS > log[dev].size - 1){
       // this op might exhaust log space; wait for commit.
       sleep(&log, &log[dev].lock);
     } else {
@@ -141,7 +240,9 @@ begin_op(int dev)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// commits if this was the last outstanding operation,
+// unless a commit is already running; that commit() will
+// go on to commit this transaction too.
 void
 end_op(int dev)
 {
@@ -149,9 +250,7 @@ end_op(int dev)
 
   acquire(&log[dev].lock);
   log[dev].outstanding -= 1;
-  if(log[dev].committing)
-    panic("log[dev].committing");
-  if(log[dev].outstanding == 0){
+  if(log[dev].outstanding == 0 && !log[dev].committing){
     do_commit = 1;
     log[dev].committing = 1;
   } else {
@@ -166,39 +265,88 @@ end_op(int dev)
     // call commit w/o holding locks, since not allowed
     // to sleep with locks.
     commit(dev);
-    acquire(&log[dev].lock);
-    log[dev].committing = 0;
-    wakeup(&log);
-    release(&log[dev].lock);
   }
 }
 
-// Copy modified blocks from cache to log.
+// Copy the modified blocks of region r's closed transaction from
+// the cache into log buffers, which stay pinned until write_log().
 static void
-write_log(int dev)
+copy_log(int dev, int r)
 {
+  struct logheader *lh = &log[dev].lh[r];
   int tail;
 
-  for (tail = 0; tail < log[dev].lh.n; tail++) {
-    struct buf *to = bread(dev, log[dev].start+tail+1); // log block
-    struct buf *from = bread(dev, log[dev].lh.block[tail]); // cache block
+  for (tail = 0; tail < lh->n; tail++) {
+    struct buf *to = bclaim(dev, regionstart(dev, r)+tail+1); // log block
+    struct buf *from = bread(dev, lh->block[tail]); // cache block
     memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
+    bpin(to);
     brelse(from);
     brelse(to);
   }
 }
 
+// Write region r's log buffers to the log, as one batch.
+static void
+write_log(int dev, int r)
+{
+  struct buf *to[LOGSIZE];
+  int tail, n;
+
+  n = log[dev].lh[r].n;
+  for (tail = 0; tail < n; tail++)
+    to[tail] = bread(dev, regionstart(dev, r)+tail+1); // log block
+  bwritev(to, n);  // write the log
+  for (tail = 0; tail < n; tail++) {
+    bunpin(to[tail]);
+    brelse(to[tail]);
+  }
+}
+
+// Commit the open transaction, and keep committing while each
+// following transaction is complete by the time its predecessor
+// is installed. Caller has set log[dev].committing.
 static void
 commit(int dev)
 {
-  if (log[dev].lh.n > 0) {
-    write_log(dev);     // Write modified blocks from cache to log
-    write_head(dev);    // Write header to disk -- the real commit
-    install_trans(dev); // Now install writes to home locations
-    log[dev].lh.n = 0;
-    write_head(dev);    // Erase the transaction from the log
+  struct log *l = &log[dev];
+  struct logheader erased;
+  int r;
+
+  acquire(&l->lock);
+  while(l->outstanding == 0 && l->lh[l->cur].n > 0){
+    // close the transaction; no FS call can be in it now.
+    r = l->cur;
+    l->closing = 1;
+    release(&l->lock);
+
+    copy_log(dev, r);
+
+    // open the next transaction in the other region.
+    acquire(&l->lock);
+    l->cur = !r;
+    l->lh[!r].n = 0;
+    l->lh[!r].seq = l->lh[r].seq + 1;
+    l->closing = 0;
+    wakeup(&log);
+    release(&l->lock);
+
+    write_log(dev, r);     // Write modified blocks from cache to log
+    write_head(dev, r, &l->lh[r]);  // Write header to disk -- the real commit
+    // Erase the previous transaction from the log. Its install
+    // may have skipped blocks in favour of this transaction, so
+    // it was kept until now.
+    erased.n = 0;
+    erased.seq = 0;
+    write_head(dev, !r, &erased);
+    install_trans(dev, r); // Now install writes to home locations
+
+    acquire(&l->lock);
+    l->lh[r].n = 0;
+    wakeup(&log);
   }
+  l->committing = 0;
+  release(&l->lock);
 }
 
 // Caller has modified b->data and is done with the buffer.
@@ -213,25 +361,25 @@ commit(int dev)
 void
 log_write(struct buf *b)
 {
+  struct logheader *lh;
   int i;
 
   int dev = b->dev;
-  if (log[dev].lh.n >= LOGSIZE || log[dev].lh.n >= log[dev].size - 1)
+  acquire(&log[dev].lock);
+  lh = &log[dev].lh[log[dev].cur];
+  if (lh->n >= LOGSIZE || lh->n >= log[dev].size - 1)
     panic("too big a transaction");
   if (log[dev].outstanding < 1)
     panic("log_write outside of trans");
 
-  acquire(&log[dev].lock);
-  for (i = 0; i < log[dev].lh.n; i++) {
-    if (log[dev].lh.block[i] == b->blockno)   // log absorbtion
+  for (i = 0; i < lh->n; i++) {
+    if (lh->block[i] == b->blockno)   // log absorbtion
       break;
   }
-  log[dev].lh.block[i] = b->blockno;
-  if (i == log[dev].lh.n) {  // Add new block to log?
+  lh->block[i] = b->blockno;
+  if (i == lh->n) {  // Add new block to log?
     bpin(b);
-    log[dev].lh.n++;
+    lh->n++;
   }
   release(&log[dev].lock);
 }
-
-
@@ -36,6 +36,7 @@ main()
     kvminithart();   // turn on paging
     // 整个系统维护一个进程数组，遍历这个数组，为每个进程初始化好内核栈
     procinit();      // process table
+    futexinit();     // futex locks
     // 初始化内核trap处理函数，中断向量
     trapinit();      // trap vectors
     trapinithart();  // install kernel trap vector
@@ -48,6 +49,7 @@ main()
     iinit();         // inode cache
     // 和上面类似，初始化打开文件数组的lock，每次access打开文件，都要先获取锁
     fileinit();      // file table
+    pipeinit();      // pipe cache
     virtio_disk_init(minor(ROOTDEV)); // emulated hard disk
     // 第一个用户进程
     userinit();      // first user process
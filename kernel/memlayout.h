@@ -15,6 +15,7 @@
 // the kernel uses physical memory thus:
 // 80000000 -- entry.S, then kernel text and data
 // end -- start of kernel page allocation area
+// PHYSTOP-BDSIZE -- buddy allocator area, for slab.c
 // PHYSTOP -- end RAM used by the kernel
 
 // qemu puts UART registers here in physical memory.
@@ -48,6 +49,11 @@
 #define KERNBASE 0x80000000L
 #define PHYSTOP (KERNBASE + 128*1024*1024)
 
+// the last BDSIZE bytes below PHYSTOP belong to the buddy
+// allocator (buddy.c), which backs the kernel object caches
+// (slab.c); kalloc() never hands them out.
+#define BDSIZE (512*1024)
+
 // map the trampoline page to the highest address,
 // in both user and kernel space.
 #define TRAMPOLINE (MAXVA - PGSIZE)
@@ -61,8 +67,17 @@
 //   text
 //   original data and bss
 //   fixed-size stack
-//   expandable heap
+//   expandable heap, never beyond MAXHEAP
+//   ...
+//   MMAPBASE
+//   mmap()ed files, top-down from MMAPTOP
 //   ...
 //   TRAPFRAME (p->tf, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
+// The heap stays below the PLIC and the uart, whose registers
+// are mapped into every user page table for the kernel's use
+// (see kvmcreate()). The mmap() area is the second 1GB.
+#define MAXHEAP (PHYSTOP - KERNBASE)
+#define MMAPBASE 0x40000000L
+#define MMAPTOP 0x80000000L
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
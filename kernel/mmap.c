@@ -0,0 +1,262 @@
+//
+// Memory-mapped files.
+//
+// Each process has a small table of virtual memory areas
+// (p->vma[]), one per mmap() call. mmap() only records the
+// area; pages are read from the file's inode when first
+// touched (see vmafault(), called from vmfault() in vm.c).
+// Writable MAP_SHARED areas are written back to the file
+// when they are unmapped, including at exit.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
+
+// Return the area of p that contains va, or 0.
+// Caller holds p->glock.
+static struct vma*
+vmalookup(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->used && va >= v->addr && va < v->addr + v->len)
+      return v;
+  }
+  return 0;
+}
+
+// Map len bytes of f, starting at file offset off, into the
+// current process. Areas are placed top-down beneath MMAPTOP.
+// Takes a new reference to f.
+// Returns the chosen address, or -1.
+uint64
+vmamap(struct file *f, uint64 len, int prot, int flags, uint64 off)
+{
+  struct proc *p = myproc()->group;
+  struct vma *v, *free;
+  uint64 top;
+
+  len = PGROUNDUP(len);
+  top = MMAPTOP;
+  free = 0;
+  acquire(&p->glock);
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->used){
+      if(v->addr < top)
+        top = v->addr;
+    } else if(free == 0){
+      free = v;
+    }
+  }
+  if(free == 0 || len > top || top - len < MMAPBASE){
+    release(&p->glock);
+    return -1;
+  }
+
+  free->used = 1;
+  free->addr = top - len;
+  free->len = len;
+  free->prot = prot;
+  free->flags = flags;
+  free->off = off;
+  free->f = filedup(f);
+  release(&p->glock);
+  return free->addr;
+}
+
+// Fault in the page of a mapped file containing va.
+// Returns the physical address of the new page,
+// or 0 if va is not in a mapped area.
+uint64
+vmafault(struct proc *p, uint64 va)
+{
+  struct vma *v;
+  struct file *f;
+  char *mem;
+  uint64 pa, off;
+  int perm;
+
+  va = PGROUNDDOWN(va);
+  // another thread may munmap() the area while the page is read
+  // in; keep the file open until then.
+  acquire(&p->glock);
+  if((v = vmalookup(p, va)) == 0){
+    release(&p->glock);
+    return 0;
+  }
+  f = filedup(v->f);
+  off = v->off + (va - v->addr);
+  // PTE_W without PTE_R is a reserved encoding, so every
+  // mapping is readable, as on most machines.
+  perm = PTE_U | PTE_R;
+  if(v->prot & PROT_WRITE)
+    perm |= PTE_W;
+  if(v->prot & PROT_EXEC)
+    perm |= PTE_X;
+  release(&p->glock);
+
+  // the part of the page beyond the end of the file reads as zeros.
+  if((mem = kalloc_zeroed()) != 0){
+    ilock(f->ip);
+    readi(f->ip, 0, (uint64)mem, off, PGSIZE);
+    iunlock(f->ip);
+  }
+  fileclose(f);
+  if(mem == 0)
+    return 0;
+
+  // another thread may have faulted the page in meanwhile,
+  // or unmapped the area.
+  acquire(&p->glock);
+  if((pa = walkaddr(p->pagetable, va)) != 0){
+    release(&p->glock);
+    kfree(mem);
+    return pa;
+  }
+  if(vmalookup(p, va) == 0 ||
+     mappages(p->pagetable, va, PGSIZE, (uint64)mem, perm) != 0){
+    release(&p->glock);
+    kfree(mem);
+    return 0;
+  }
+  release(&p->glock);
+  return (uint64)mem;
+}
+
+// Write the resident pages of [addr, addr+len) back to v's file,
+// but never past its current end.
+static void
+vmawriteback(struct proc *p, struct vma *v, uint64 addr, uint64 len)
+{
+  struct inode *ip = v->f->ip;
+  uint64 va, pa;
+  uint off, n;
+
+  for(va = addr; va < addr + len; va += PGSIZE){
+    // hold on to the page, in case another thread unmaps it.
+    acquire(&p->glock);
+    if((pa = walkaddr(p->pagetable, va)) != 0)
+      kref((void*)pa);
+    release(&p->glock);
+    if(pa == 0)
+      continue;
+    off = v->off + (va - v->addr);
+    // one page per transaction: four data blocks and the
+    // inode, well within MAXOPBLOCKS.
+    begin_op(ip->dev);
+    ilock(ip);
+    if(off < ip->size){
+      n = ip->size - off;
+      if(n > PGSIZE)
+        n = PGSIZE;
+      writei(ip, 0, pa, off, n);
+    }
+    iunlock(ip);
+    end_op(ip->dev);
+    kfree((void*)pa);
+  }
+}
+
+// Unmap [addr, addr+len) of the current process, which must lie
+// within one area and start or end at that area's boundary.
+// Returns 0 on success, -1 on failure.
+int
+vmaunmap(struct proc *p, uint64 addr, uint64 len)
+{
+  struct vma *v, copy;
+  struct file *f = 0;
+
+  if(addr % PGSIZE != 0 || len == 0)
+    return -1;
+  len = PGROUNDUP(len);
+  // the write-back sleeps, so the area is checked again after
+  // it, in case another thread has changed it meanwhile.
+  for(int pass = 0; ; pass++){
+    acquire(&p->glock);
+    if((v = vmalookup(p, addr)) == 0 || addr + len > v->addr + v->len ||
+       // punching a hole would split the area in two.
+       (addr != v->addr && addr + len != v->addr + v->len)){
+      release(&p->glock);
+      return -1;
+    }
+    if(pass == 1)
+      break;
+    copy = *v;
+    filedup(copy.f);
+    release(&p->glock);
+    if((copy.flags & MAP_SHARED) && (copy.prot & PROT_WRITE))
+      vmawriteback(p, &copy, addr, len);
+    fileclose(copy.f);
+  }
+
+  uvmunmap(p->pagetable, addr, len, 1);
+  if(addr == v->addr){
+    v->addr += len;
+    v->off += len;
+  }
+  v->len -= len;
+  if(v->len == 0){
+    f = v->f;
+    v->f = 0;
+    v->used = 0;
+  }
+  release(&p->glock);
+  if(f)
+    fileclose(f);
+  return 0;
+}
+
+// Unmap all of p's areas, as at exit() and exec().
+void
+vmafree(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->used)
+      vmaunmap(p, v->addr, v->len);
+  }
+}
+
+// Give fork()'s child np the parent p's areas. Resident pages
+// of private areas become copy-on-write; shared areas keep
+// sharing the same physical pages.
+// Returns 0 on success, -1 on failure.
+int
+vmacopy(struct proc *p, struct proc *np)
+{
+  struct vma *v, *nv;
+
+  for(v = p->vma, nv = np->vma; v < &p->vma[NVMA]; v++, nv++){
+    if(!v->used)
+      continue;
+    if(uvmshare(p->pagetable, np->pagetable, v->addr, v->len,
+                v->flags & MAP_PRIVATE) < 0)
+      goto err;
+    *nv = *v;
+    filedup(nv->f);
+  }
+  return 0;
+
+ err:
+  // the parent still holds a reference to every file,
+  // so these fileclose()s never sleep.
+  for(nv = np->vma; nv < &np->vma[NVMA]; nv++){
+    if(nv->used){
+      uvmunmap(np->pagetable, nv->addr, nv->len, 1);
+      fileclose(nv->f);
+      nv->used = 0;
+    }
+  }
+  return -1;
+}
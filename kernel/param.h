@@ -1,14 +1,18 @@
-#define NPROC        10  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
+#define NPRIO         3  // scheduling priorities, 0 is the highest
+#define BOOSTTICKS   50  // ticks between resets to base priority
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NVMA         16  // mmap()ed areas per process
+#define NSEG          4  // loadable ELF segments per program
+#define NFILE       100  // open files per system (no longer a limit)
+#define NINODE       50  // i-nodes to cache; more only if all are in use
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       0  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       2000  // size of file system in blocks
+#define LOGSIZE      (MAXOPBLOCKS*6)  // max data blocks in one log transaction
+#define NBUF         (LOGSIZE*3+MAXOPBLOCKS*3)  // size of disk block cache; more only if all are in use
+#define MAXRA        32  // max blocks of sequential readahead per file
+#define FSSIZE       200000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
 #define NDISK        2
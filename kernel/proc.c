@@ -11,45 +11,365 @@
 
 struct cpu cpus[NCPU];
 
-struct proc proc[NPROC];
+// The process table grows on demand: when no struct proc is
+// free, allocproc() takes a few more from the proc kcache,
+// each with its own kernel stack. Once more than PKEEP are free,
+// wait() gives the rest back to the cache, stacks and all (see
+// proctrim()), so that a fork storm does not keep their memory.
+// A free proc is given back only when no one can still be
+// looking at it: ptable.all is walked under ptable.lock, and
+// findproc() counts itself in p->findref until it holds p->lock.
+struct {
+  struct spinlock lock;  // held while growing, trimming or walking all
+  struct proc *all;   // every proc, linked through p->allnext
+  int nfree;          // procs on the free lists
+  struct kcache *cache;
+} ptable;
+
+#define PGROW 8     // procs made at a time by procgrow()
+#define PKEEP 64    // free procs that proctrim() leaves alone
+
+// kernel stack slots in use. There cannot be more procs than
+// pages of memory, since each has a kernel stack page.
+#define NSLOT ((PHYSTOP - KERNBASE) / PGSIZE)
+static uchar slotmap[NSLOT/8];
+
+// UNUSED procs, linked through p->freenext. Each CPU frees procs
+// onto its own list and allocates from it, so that CPUs forking
+// at the same time do not contend; a CPU whose list is empty
+// takes from the others before it grows the table.
+struct pfree {
+  struct spinlock lock;
+  struct proc *head;
+} pfree[NCPU];
+
+static char *pfree_names[NCPU] = {
+  "pfree0", "pfree1", "pfree2", "pfree3", "pfree4", "pfree5", "pfree6", "pfree7",
+};
+
+// bumped whenever a kernel stack is mapped or unmapped; each CPU
+// flushes its TLB when it sees a new value, before it runs any
+// process, so that it never uses a stale mapping of a slot.
+uint kvmgen;
+
+// protects p->parent and the child lists, so that a parent in
+// wait() cannot miss a child's exit(). Acquire before any p->lock.
+struct spinlock wait_lock;
 
 struct proc *initproc;
 
+// Each CPU has a queue of RUNNABLE processes, linked through
+// p->rqnext. A process is queued on the CPU that makes it
+// RUNNABLE; a CPU whose queue is empty steals from the others.
+//
+// The queues are multilevel feedback queues: each has one list
+// per priority (0 is the highest), and the scheduler takes from
+// the highest non-empty one. A process runs QUANTUM(p->prio)
+// ticks at a priority before it is moved down one, whether or
+// not it sleeps in between, so CPU hogs sink while processes that
+// mostly wait, like sh, stay on top. Every BOOSTTICKS ticks all
+// processes go back to their base priority (set by setpriority()),
+// so that the low ones are not starved for good: a queue moves its
+// processes up the next time a CPU takes from it, and each process
+// has its priority reset when it next runs or is queued.
+#define QUANTUM(prio) (1 << (prio))
+
+struct runq {
+  struct spinlock lock;
+  struct proc *head[NPRIO];
+  struct proc *tail[NPRIO];
+  int n;
+  uint boost;   // boostgen when the lists were last boosted
+} runq[NCPU];
+
+// bumped by prioboost(); a process whose p->boost differs
+// has missed a boost.
+uint boostgen;
+
+static char *runq_names[NCPU] = {
+  "runq0", "runq1", "runq2", "runq3", "runq4", "runq5", "runq6", "runq7",
+};
+
+// Processes in sleep() are kept on a hash table of queues keyed
+// by channel, so that wakeup() looks only at the processes that
+// might be sleeping on its channel instead of the whole table.
+// A process stays queued until it returns from sleep(), whoever
+// woke it; wakeup() only makes it RUNNABLE.
+#define NSLEEPQ 31
+
+struct sleepq {
+  struct spinlock lock;
+  struct proc *head;
+} sleepq[NSLEEPQ];
+
+static struct sleepq*
+sqhash(void *chan)
+{
+  return &sleepq[((uint64)chan >> 3) % NSLEEPQ];
+}
+
+// pids come from an atomic counter, so fork() takes no lock for one.
 int nextpid = 1;
-struct spinlock pid_lock;
+
+// procs by pid, for kill(); linked through p->pidnext.
+// each bucket has its own lock.
+#define NPIDHASH 61
+
+struct {
+  struct spinlock lock;
+  struct proc *head;
+} pidhash[NPIDHASH];
 
 extern void forkret(void);
 static void wakeup1(struct proc *chan);
+static void killthreads(struct proc *p);
+static void freeproc(struct proc *p);
+static void addchild(struct proc *p, struct proc *np);
+static struct proc* findproc(int pid);
+static void proctrim(void);
+static void pfreeput(struct pfree *f, struct proc *p);
+static struct proc* pfreeany(void);
 
 extern char trampoline[]; // trampoline.S
+extern pagetable_t kernel_pagetable; // vm.c
 
 void
 procinit(void)
+{
+  initlock(&ptable.lock, "ptable");
+  ptable.cache = kcachecreate("proc", sizeof(struct proc));
+  for(int i = 0; i < NCPU; i++)
+    initlock(&pfree[i].lock, pfree_names[i]);
+  for(int i = 0; i < NPIDHASH; i++)
+    initlock(&pidhash[i].lock, "pidhash");
+  initlock(&wait_lock, "wait_lock");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&runq[i].lock, runq_names[i]);
+  for(int i = 0; i < NSLEEPQ; i++)
+    initlock(&sleepq[i].lock, "sleepq");
+  // procs are made by procgrow(), as they are needed.
+  kvminithart();
+}
+
+// Make up to PGROW new procs and put them on free list f.
+// Caller holds ptable.lock.
+// Returns 0 on success, -1 if out of memory.
+static int
+procgrow(struct pfree *f)
 {
   struct proc *p;
-  
-  initlock(&pid_lock, "nextpid");
-  // 遍历整个proc数组
-  for(p = proc; p < &proc[NPROC]; p++) {
-      initlock(&p->lock, "proc");
-
-      // Allocate a page for the process's kernel stack.
-      // Map it high in memory, followed by an invalid
-      // guard page.
-      // 分配一个页面
-      char *pa = kalloc();
-      if(pa == 0)
-        panic("kalloc");
-      // 每个进程的内核栈放在进程页表的固定位置，也就是trampoline下面的第二个页面
-      // 因为中间有一个空闲页面作为分割
-      uint64 va = KSTACK((int) (p - proc));
-      // 映射每个进程的栈
-      // TODO: 有个问题，为啥要在procinit的时候，为每个进程alloc内核栈空间呢？
-      // 而且每个进程的内核栈映射到的进程空间地址不同？
-      kvmmap(va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
-      p->kstack = va;
+  char *pa;
+  int i, slot;
+
+  for(i = 0; i < PGROW; i++){
+    for(slot = 0; slot < NSLOT; slot++)
+      if((slotmap[slot/8] & (1 << (slot%8))) == 0)
+        break;
+    if(slot == NSLOT)
+      break;
+    if((p = kcachealloc(ptable.cache)) == 0)
+      break;
+    memset(p, 0, sizeof(*p));
+
+    // Allocate a page for the process's kernel stack.
+    // Map it high in memory, followed by an invalid
+    // guard page.
+    // 每个进程的内核栈映射到内核地址空间中自己的slot，下面有一个guard page
+    if((pa = kalloc()) == 0){
+      kcachefree(ptable.cache, p);
+      break;
+    }
+    if(mappages(kernel_pagetable, KSTACK(slot), PGSIZE,
+                (uint64)pa, PTE_R | PTE_W) != 0){
+      kfree(pa);
+      kcachefree(ptable.cache, p);
+      break;
+    }
+    initobjlock(&p->lock, "proc");
+    initobjlock(&p->glock, "group");
+    slotmap[slot/8] |= 1 << (slot%8);
+    p->slot = slot;
+    p->kstack = KSTACK(p->slot);
+    p->allnext = ptable.all;
+    ptable.all = p;
+    pfreeput(f, p);
   }
-  kvminithart();
+  if(i == 0)
+    return -1;
+  sfence_vma();
+  __sync_fetch_and_add(&kvmgen, 1);
+  return 0;
+}
+
+// Give free procs beyond PKEEP back to the proc cache, and
+// unmap and free their kernel stacks.
+static void
+proctrim(void)
+{
+  struct proc *p, **pp;
+  struct pfree *f;
+
+  push_off();
+  f = &pfree[cpuid()];
+  pop_off();
+
+  // peek without the lock; a few too many or too few is fine.
+  while(ptable.nfree > PKEEP){
+    if((p = pfreeany()) == 0)
+      break;
+    acquire(&ptable.lock);
+    // findproc() may have found p before it was freed, and not
+    // taken p->lock yet; leave p be.
+    __sync_synchronize();
+    if(p->findref > 0){
+      release(&ptable.lock);
+      pfreeput(f, p);
+      break;
+    }
+    // or it has, and its caller still holds p->lock.
+    acquire(&p->lock);
+    release(&p->lock);
+    for(pp = &ptable.all; *pp != p; pp = &(*pp)->allnext)
+      ;
+    *pp = p->allnext;
+    kvmunmap(p->kstack);
+    slotmap[p->slot/8] &= ~(1 << (p->slot%8));
+    kcachefree(ptable.cache, p);
+    release(&ptable.lock);
+    // another proc may get the slot, with a new stack page.
+    __sync_fetch_and_add(&kvmgen, 1);
+  }
+}
+
+// Mark p RUNNABLE and put it at the tail of this CPU's run queue
+// for its priority.
+// Caller must hold p->lock (so interrupts are off).
+static void
+setrunnable(struct proc *p)
+{
+  struct runq *q = &runq[cpuid()];
+
+  if(p->boost != boostgen){
+    p->boost = boostgen;
+    p->prio = p->baseprio;
+    p->slice = 0;
+  }
+  p->state = RUNNABLE;
+  acquire(&q->lock);
+  p->rqnext = 0;
+  if(q->tail[p->prio])
+    q->tail[p->prio]->rqnext = p;
+  else
+    q->head[p->prio] = p;
+  q->tail[p->prio] = p;
+  q->n++;
+  release(&q->lock);
+}
+
+// Apply a priority boost to the processes waiting in q: move
+// each to the list of its base priority. Their p->prio is reset
+// when they run (see scheduler()), under p->lock, which cannot be
+// taken here. Caller holds q->lock.
+static void
+runqboost(struct runq *q)
+{
+  struct proc *p, *next, *head[NPRIO];
+  int i, prio;
+
+  q->boost = boostgen;
+  for(i = 0; i < NPRIO; i++){
+    head[i] = q->head[i];
+    q->head[i] = q->tail[i] = 0;
+  }
+  for(i = 0; i < NPRIO; i++){
+    for(p = head[i]; p; p = next){
+      next = p->rqnext;
+      prio = p->baseprio;
+      p->rqnext = 0;
+      if(q->tail[prio])
+        q->tail[prio]->rqnext = p;
+      else
+        q->head[prio] = p;
+      q->tail[prio] = p;
+    }
+  }
+}
+
+// Take the highest-priority process in q, or return 0.
+static struct proc*
+runqget(struct runq *q)
+{
+  struct proc *p = 0;
+
+  acquire(&q->lock);
+  if(q->boost != boostgen)
+    runqboost(q);
+  for(int i = 0; i < NPRIO; i++){
+    if((p = q->head[i]) != 0){
+      q->head[i] = p->rqnext;
+      if(q->head[i] == 0)
+        q->tail[i] = 0;
+      q->n--;
+      break;
+    }
+  }
+  release(&q->lock);
+  return p;
+}
+
+// Charge the running process for a clock tick; called on every
+// CPU's timer interrupt. Returns 1 if it should yield, because it
+// has used up its quantum or a higher-priority process is waiting
+// on this CPU.
+int
+proctick(void)
+{
+  struct proc *p = myproc();
+  struct runq *q = &runq[cpuid()];
+  int yield = 0;
+
+  acquire(&p->lock);
+  p->rtime++;
+  if(++p->slice >= QUANTUM(p->prio)){
+    if(p->prio < NPRIO-1)
+      p->prio++;
+    p->slice = 0;
+    yield = 1;
+  }
+  // no q->lock; a stale look only delays the switch a tick.
+  for(int i = 0; i < p->prio; i++)
+    if(q->head[i])
+      yield = 1;
+  release(&p->lock);
+  return yield;
+}
+
+// Return every process to its base priority, as each is next
+// queued or run, or its queue next taken from; called from
+// clockintr() every BOOSTTICKS ticks.
+void
+prioboost(void)
+{
+  __sync_fetch_and_add(&boostgen, 1);
+}
+
+// Set the base priority of the process with the given pid,
+// and move it there now.
+int
+setpriority(int pid, int prio)
+{
+  struct proc *p;
+
+  if(prio < 0 || prio >= NPRIO)
+    return -1;
+  if((p = findproc(pid)) == 0)
+    return -1;
+  // a queued process stays in its list until it next runs.
+  p->baseprio = prio;
+  p->prio = prio;
+  p->slice = 0;
+  release(&p->lock);
+  return 0;
 }
 
 // Must be called with interrupts disabled,
@@ -81,52 +401,195 @@ myproc(void) {
   return p;
 }
 
-int
-allocpid() {
-  int pid;
-  
-  acquire(&pid_lock);
-  pid = nextpid;
-  nextpid = nextpid + 1;
-  release(&pid_lock);
+// Give p a new pid and enter it in pidhash.
+static void
+allocpid(struct proc *p)
+{
+  int h;
+
+  p->pid = __sync_fetch_and_add(&nextpid, 1);
+  h = p->pid % NPIDHASH;
+  acquire(&pidhash[h].lock);
+  p->pidnext = pidhash[h].head;
+  pidhash[h].head = p;
+  release(&pidhash[h].lock);
+}
 
-  return pid;
+// Take p out of pidhash.
+static void
+freepid(struct proc *p)
+{
+  struct proc **pp;
+  int h = p->pid % NPIDHASH;
+
+  acquire(&pidhash[h].lock);
+  for(pp = &pidhash[h].head; *pp; pp = &(*pp)->pidnext){
+    if(*pp == p){
+      *pp = p->pidnext;
+      break;
+    }
+  }
+  release(&pidhash[h].lock);
+  p->pidnext = 0;
 }
 
-// Look in the process table for an UNUSED proc.
-// If found, initialize state required to run in the kernel,
-// and return with p->lock held.
-// If there are no free procs, return 0.
+// Find the process with the given pid, and return it
+// with p->lock held, or return 0.
 static struct proc*
-allocproc(void)
+findproc(int pid)
 {
   struct proc *p;
+  int h = pid % NPIDHASH;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if(p->state == UNUSED) {
-      goto found;
-    } else {
-      release(&p->lock);
-    }
+  acquire(&pidhash[h].lock);
+  for(p = pidhash[h].head; p; p = p->pidnext){
+    if(p->pid == pid)
+      break;
+  }
+  // keep proctrim() from giving p back to the cache
+  // until p->lock is held.
+  if(p)
+    __sync_fetch_and_add(&p->findref, 1);
+  release(&pidhash[h].lock);
+  if(p == 0)
+    return 0;
+  acquire(&p->lock);
+  __sync_fetch_and_sub(&p->findref, 1);
+  // it may have been freed since.
+  if(p->pid != pid || p->state == UNUSED){
+    release(&p->lock);
+    return 0;
+  }
+  return p;
+}
+
+// Take the first proc on free list f, or return 0.
+static struct proc*
+pfreeget(struct pfree *f)
+{
+  struct proc *p;
+
+  acquire(&f->lock);
+  if((p = f->head) != 0){
+    f->head = p->freenext;
+    __sync_fetch_and_sub(&ptable.nfree, 1);
+  }
+  release(&f->lock);
+  return p;
+}
+
+// Put p on free list f.
+static void
+pfreeput(struct pfree *f, struct proc *p)
+{
+  acquire(&f->lock);
+  p->freenext = f->head;
+  f->head = p;
+  __sync_fetch_and_add(&ptable.nfree, 1);
+  release(&f->lock);
+}
+
+// Take a proc from this CPU's free list, or another CPU's,
+// or return 0 if all are empty.
+static struct proc*
+pfreeany(void)
+{
+  struct proc *p;
+  int id, i;
+
+  push_off();
+  id = cpuid();
+  pop_off();
+
+  if((p = pfreeget(&pfree[id])) != 0)
+    return p;
+  for(i = 1; i < NCPU; i++){
+    // peek without the lock; pfreeget() checks again.
+    if(pfree[(id+i) % NCPU].head == 0)
+      continue;
+    if((p = pfreeget(&pfree[(id+i) % NCPU])) != 0)
+      return p;
   }
   return 0;
+}
+
+// Take a proc from this CPU's free list, or another CPU's,
+// growing the table if all are empty.
+// Returns 0 if there is no memory for more procs.
+static struct proc*
+proctake(void)
+{
+  struct proc *p;
+  struct pfree *f;
 
-found:
-  p->pid = allocpid();
+  push_off();
+  f = &pfree[cpuid()];
+  pop_off();
+
+  for(;;){
+    if((p = pfreeany()) != 0)
+      return p;
+    acquire(&ptable.lock);
+    // another CPU may have grown the table, or freed procs
+    // onto f, while this one looked.
+    if(f->head == 0 && procgrow(f) < 0){
+      release(&ptable.lock);
+      return 0;
+    }
+    release(&ptable.lock);
+  }
+}
+
+// Take a free proc, growing the table if need be.
+// Initialize state required to run in the kernel,
+// and return with p->lock held.
+// If there is no memory for more procs, return 0.
+static struct proc*
+allocproc(void)
+{
+  struct proc *p;
+
+  if((p = proctake()) == 0)
+    return 0;
+
+  acquire(&p->lock);
+  if(p->state != UNUSED)
+    panic("allocproc");
+  allocpid(p);
+  p->baseprio = 0;
+  p->prio = 0;
+  p->slice = 0;
+  p->boost = boostgen;
+  p->rtime = 0;
+  p->group = p;
+  p->nthread = 0;
+  p->tfva = TRAPFRAME;
+  p->asid = 0;
 
   // NOTE: 注意区分，下面的内容是在内核状态下，进程创建出来之后必要的ra，sp等状态
 
   // Allocate a trapframe page.
   // 分配一个页面作为trapframe使用，也就是syscall陷入内核的上下文放在这儿
   if((p->tf = (struct trapframe *)kalloc()) == 0){
+    freeproc(p);
     release(&p->lock);
     return 0;
   }
 
   // An empty user page table.
   // 初始化进程的页表，映射一些固定的内容，trampoline以及trapframe到固定位置
-  p->pagetable = proc_pagetable(p);
+  if((p->pagetable = proc_pagetable(p)) == 0){
+    freeproc(p);
+    release(&p->lock);
+    return 0;
+  }
+
+  // the kernel page table to run in on p's behalf.
+  if((p->kpagetable = kvmcreate(p->pagetable)) == 0){
+    freeproc(p);
+    release(&p->lock);
+    return 0;
+  }
 
   // Set up new context to start executing at forkret,
   // which returns to user space.
@@ -145,13 +608,22 @@ found:
 static void
 freeproc(struct proc *p)
 {
+  struct pfree *f;
+
   if(p->tf)
     kfree((void*)p->tf);
   p->tf = 0;
-  if(p->pagetable)
+  // a thread's page table belongs to its group leader.
+  if(p->pagetable && p->group == p)
     proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
+  if(p->kpagetable && p->group == p)
+    kfree((void*)p->kpagetable);
+  p->kpagetable = 0;
+  p->group = 0;
   p->sz = 0;
+  p->nseg = 0;
+  freepid(p);
   p->pid = 0;
   p->parent = 0;
   p->name[0] = 0;
@@ -159,6 +631,10 @@ freeproc(struct proc *p)
   p->killed = 0;
   p->xstate = 0;
   p->state = UNUSED;
+
+  // p->lock is held, so interrupts are off and cpuid() is stable.
+  f = &pfree[cpuid()];
+  pfreeput(f, p);
 }
 
 // Create a page table for a given process,
@@ -171,6 +647,8 @@ proc_pagetable(struct proc *p)
   // An empty page table.
   // alloc分配一个页表
   pagetable = uvmcreate();
+  if(pagetable == 0)
+    return 0;
 
   // map the trampoline code (for system call return)
   // at the highest user virtual address.
@@ -178,12 +656,27 @@ proc_pagetable(struct proc *p)
   // to/from user space, so not PTE_U.
   // 分别把trampoline以及trapframe映射到对应位置
   // [   ...    ][trapframe][trampoline] 这两个页面分别在进程地址空间最后的位置
-  mappages(pagetable, TRAMPOLINE, PGSIZE,
-           (uint64)trampoline, PTE_R | PTE_X);
+  if(mappages(pagetable, TRAMPOLINE, PGSIZE,
+              (uint64)trampoline, PTE_R | PTE_X) < 0){
+    uvmfree(pagetable, 0);
+    return 0;
+  }
 
   // map the trapframe just below TRAMPOLINE, for trampoline.S.
-  mappages(pagetable, TRAPFRAME, PGSIZE,
-           (uint64)(p->tf), PTE_R | PTE_W);
+  if(mappages(pagetable, TRAPFRAME, PGSIZE,
+              (uint64)(p->tf), PTE_R | PTE_W) < 0){
+    uvmunmap(pagetable, TRAMPOLINE, PGSIZE, 0);
+    uvmfree(pagetable, 0);
+    return 0;
+  }
+
+  // the kernel's devices, for the kernel page table.
+  if(uvmkmap(pagetable) < 0){
+    uvmunmap(pagetable, TRAMPOLINE, PGSIZE, 0);
+    uvmunmap(pagetable, TRAPFRAME, PGSIZE, 0);
+    uvmfree(pagetable, 0);
+    return 0;
+  }
 
   return pagetable;
 }
@@ -195,8 +688,8 @@ proc_freepagetable(pagetable_t pagetable, uint64 sz)
 {
   uvmunmap(pagetable, TRAMPOLINE, PGSIZE, 0);
   uvmunmap(pagetable, TRAPFRAME, PGSIZE, 0);
-  if(sz > 0)
-    uvmfree(pagetable, sz);
+  uvmkunmap(pagetable);
+  uvmfree(pagetable, sz);
 }
 
 // a user program that calls exec("/init")
@@ -246,29 +739,57 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
   // 设置进程状态为RUNNABLE，即可以被调度执行的
-  p->state = RUNNABLE;
+  setrunnable(p);
 
   release(&p->lock);
 }
 
 // Grow or shrink user memory by n bytes.
-// Return 0 on success, -1 on failure.
-int
+// Growing only reserves the address space; pages are
+// allocated when first touched (see vmfault()).
+// Return the old size on success, -1 on failure; another
+// thread may change the size as soon as glock is released.
+uint64
 growproc(int n)
 {
-  uint sz;
-  struct proc *p = myproc();
+  uint64 sz, oldsz;
+  struct proc *p = myproc()->group;
 
-  sz = p->sz;
+  acquire(&p->glock);
+  sz = oldsz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
+    // the heap must not run into the mmap() area, and no
+    // process can use more than all of RAM anyway.
+    if(sz + n > MAXHEAP){
+      release(&p->glock);
       return -1;
     }
+    sz += n;
   } else if(n < 0){
+    if((uint64)-n > sz){
+      release(&p->glock);
+      return -1;
+    }
     sz = uvmdealloc(p->pagetable, sz, sz + n);
+    segtrim(p, sz);
   }
   p->sz = sz;
-  return 0;
+  release(&p->glock);
+  return oldsz;
+}
+
+// Make np a child of p.
+static void
+addchild(struct proc *p, struct proc *np)
+{
+  acquire(&wait_lock);
+  np->parent = p;
+  np->sibnext = p->children;
+  if(p->children)
+    p->children->sibprev = &np->sibnext;
+  p->children = np;
+  np->sibprev = &p->children;
+  release(&wait_lock);
 }
 
 // Create a new process, copying the parent.
@@ -280,6 +801,7 @@ fork(void)
   int i, pid;
   struct proc *np;
   struct proc *p = myproc();
+  struct proc *g = p->group;  // memory and files, if p is a thread
 
   // Allocate process.
   if((np = allocproc()) == 0){
@@ -288,14 +810,27 @@ fork(void)
 
   // Copy user memory from parent to child.
   // 根据页表，逐项拷贝每个页面
-  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+  // (the parent's threads must not fault pages in meanwhile.)
+  acquire(&g->glock);
+  if(uvmcopy(g->pagetable, np->pagetable, g->sz) < 0){
+    release(&g->glock);
     freeproc(np);
     release(&np->lock);
     return -1;
   }
-  np->sz = p->sz;
+  np->sz = g->sz;
 
-  np->parent = p;
+  if(vmacopy(g, np) < 0){
+    release(&g->glock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  // the child faults in the same program's pages.
+  memmove(np->seg, g->seg, sizeof(g->seg));
+  np->nseg = g->nseg;
+  np->exe = g->exe ? exedup(g->exe) : 0;
+  release(&g->glock);
 
   // copy saved user registers.
   *(np->tf) = *(p->tf);
@@ -307,49 +842,158 @@ fork(void)
   np->tf->a0 = 0;
 
   // increment reference counts on open file descriptors.
+  // another thread may close them meanwhile.
+  acquire(&g->glock);
   for(i = 0; i < NOFILE; i++)
-    if(p->ofile[i])
-      np->ofile[i] = filedup(p->ofile[i]);
+    if(g->ofile[i])
+      np->ofile[i] = filedup(g->ofile[i]);
+  release(&g->glock);
   np->cwd = idup(p->cwd);
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
+  np->baseprio = p->baseprio;
+  np->prio = p->baseprio;
+
   // np的pid是在allocproc中分配的，fork函数最后返回np->pid
   // 最后写入p->tf->a0，这个p是当前进程
   // if(ret = for() > 0) { // current proc stuff... }
   pid = np->pid;
 
-  np->state = RUNNABLE;
+  release(&np->lock);
+
+  addchild(p, np);
 
+  acquire(&np->lock);
+  setrunnable(np);
   release(&np->lock);
 
   return pid;
 }
 
 // Pass p's abandoned children to init.
-// Caller must hold p->lock.
-void
+// Caller must hold wait_lock.
+static void
 reparent(struct proc *p)
 {
-  struct proc *pp;
-
-  for(pp = proc; pp < &proc[NPROC]; pp++){
-    // this code uses pp->parent without holding pp->lock.
-    // acquiring the lock first could cause a deadlock
-    // if pp or a child of pp were also in exit()
-    // and about to try to lock p.
-    if(pp->parent == p){
-      // pp->parent can't change between the check and the acquire()
-      // because only the parent changes it, and we're the parent.
-      acquire(&pp->lock);
-      pp->parent = initproc;
-      // we should wake up init here, but that would require
-      // initproc->lock, which would be a deadlock, since we hold
-      // the lock on one of init's children (pp). this is why
-      // exit() always wakes init (before acquiring any locks).
-      release(&pp->lock);
+  struct proc *pp, *last;
+
+  if(p->children == 0)
+    return;
+  for(pp = p->children; pp; pp = pp->sibnext){
+    pp->parent = initproc;
+    last = pp;
+  }
+  // splice the whole list onto the front of init's.
+  last->sibnext = initproc->children;
+  if(initproc->children)
+    initproc->children->sibprev = &last->sibnext;
+  initproc->children = p->children;
+  p->children->sibprev = &initproc->children;
+  p->children = 0;
+  // some may be zombies already.
+  wakeup(initproc);
+}
+
+// Create a thread: a process that shares the caller's page table,
+// memory and open files, and starts in user space at fn(arg) with
+// its stack pointer at stack. fn must not return; it ends with
+// exit(). The thread gets its own trapframe, mapped beneath
+// TRAPFRAME, and its own kernel stack; it is a child of the caller
+// and is reaped by wait(). When the group leader exits, it kills
+// the other threads and waits for them first.
+// Returns the new thread's pid, or -1.
+int
+clone(uint64 fn, uint64 arg, uint64 stack)
+{
+  struct proc *np;
+  struct proc *p = myproc();
+  struct proc *g = p->group;
+  int pid;
+
+  // count it now, while no other proc lock is held.
+  acquire(&g->lock);
+  g->nthread++;
+  release(&g->lock);
+
+  if((np = allocproc()) == 0)
+    goto bad;
+
+  // use the group's page tables instead of the new ones.
+  proc_freepagetable(np->pagetable, 0);
+  np->pagetable = 0;
+  kfree((void*)np->kpagetable);
+  np->kpagetable = g->kpagetable;
+  np->tfva = TRAPFRAME - (np->slot + 1) * PGSIZE;
+  acquire(&g->glock);
+  if(mappages(g->pagetable, np->tfva, PGSIZE, (uint64)np->tf, PTE_R | PTE_W) != 0){
+    release(&g->glock);
+    freeproc(np);
+    release(&np->lock);
+    goto bad;
+  }
+  release(&g->glock);
+  np->pagetable = g->pagetable;
+  np->group = g;
+
+  *(np->tf) = *(p->tf);
+  np->tf->epc = fn;
+  np->tf->a0 = arg;
+  np->tf->sp = stack;
+  np->tf->ra = 0;
+
+  np->cwd = idup(p->cwd);
+  safestrcpy(np->name, p->name, sizeof(p->name));
+  np->baseprio = p->baseprio;
+  np->prio = p->baseprio;
+
+  pid = np->pid;
+  release(&np->lock);
+
+  addchild(p, np);
+
+  acquire(&np->lock);
+  setrunnable(np);
+  release(&np->lock);
+  return pid;
+
+bad:
+  acquire(&g->lock);
+  g->nthread--;
+  release(&g->lock);
+  return -1;
+}
+
+// Kill the other threads of p's group and wait until they
+// have all exited. p is the group leader.
+static void
+killthreads(struct proc *p)
+{
+  struct proc *t;
+
+  acquire(&p->lock);
+  while(p->nthread > 0){
+    release(&p->lock);
+    // a thread cloned since the last pass is caught by the next;
+    // the thread that cloned it wakes us when it exits.
+    acquire(&ptable.lock);
+    for(t = ptable.all; t; t = t->allnext){
+      if(t == p || t->group != p)
+        continue;
+      acquire(&t->lock);
+      if(t->group == p && t->state != UNUSED && t->state != ZOMBIE){
+        t->killed = 1;
+        if(t->state == SLEEPING)
+          setrunnable(t);
+      }
+      release(&t->lock);
     }
+    release(&ptable.lock);
+    acquire(&p->lock);
+    if(p->nthread > 0)
+      sleep(p, &p->lock);
   }
+  release(&p->lock);
 }
 
 // Exit the current process.  Does not return.
@@ -363,60 +1007,65 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
-  // Close all open files.
-  for(int fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd]){
-      struct file *f = p->ofile[fd];
-      fileclose(f);
-      p->ofile[fd] = 0;
+  if(p->group != p){
+    // a thread: memory and files stay with the group. Take
+    // the trapframe out of the shared page table, and let the
+    // leader know, since it may be waiting to free the rest.
+    struct proc *g = p->group;
+    // the leader may free the group's page tables once this
+    // thread is gone, so stop running on them.
+    p->kpagetable = 0;
+    kvmuse(0);
+    acquire(&g->glock);
+    uvmunmap(p->pagetable, p->tfva, PGSIZE, 0);
+    release(&g->glock);
+    acquire(&g->lock);
+    g->nthread--;
+    wakeup1(g);
+    release(&g->lock);
+  } else {
+    // the other threads use what is about to be freed.
+    killthreads(p);
+
+    // Write back and unmap mmap()ed files.
+    vmafree(p);
+
+    // Close all open files.
+    for(int fd = 0; fd < NOFILE; fd++){
+      if(p->ofile[fd]){
+        struct file *f = p->ofile[fd];
+        fileclose(f);
+        p->ofile[fd] = 0;
+      }
     }
   }
 
   begin_op(ROOTDEV);
   iput(p->cwd);
+  if(p->exe)
+    exeput(p->exe);
   end_op(ROOTDEV);
   p->cwd = 0;
+  p->exe = 0;
 
-  // we might re-parent a child to init. we can't be precise about
-  // waking up init, since we can't acquire its lock once we've
-  // acquired any other proc lock. so wake up init whether that's
-  // necessary or not. init may miss this wakeup, but that seems
-  // harmless.
-  acquire(&initproc->lock);
-  // 为什么要walkup initproc呢？，此时initproc已经是user/init.c了
-  wakeup1(initproc);
-  release(&initproc->lock);
-
-  // grab a copy of p->parent, to ensure that we unlock the same
-  // parent we locked. in case our parent gives us away to init while
-  // we're waiting for the parent lock. we may then race with an
-  // exiting parent, but the result will be a harmless spurious wakeup
-  // to a dead or wrong process; proc structs are never re-allocated
-  // as anything else.
-  acquire(&p->lock);
-  struct proc *original_parent = p->parent;
-  release(&p->lock);
-  
-  // we need the parent's lock in order to wake it up from wait().
-  // the parent-then-child rule says we have to lock it first.
-  acquire(&original_parent->lock);
-
-  acquire(&p->lock);
+  acquire(&wait_lock);
 
   // Give any children to init.
-  // 遍历所有进程，把p的所有子进程的父进程设置为initproc
+  // 把p的所有子进程的父进程设置为initproc
   reparent(p);
 
   // Parent might be sleeping in wait().
   // 把父进程唤醒，从这儿可以看到父进程可能有多个子进程，任何一个exit都会唤醒父进程
-  wakeup1(original_parent);
+  wakeup(p->parent);
+
+  acquire(&p->lock);
 
   // 可以看到子进程调用exit在这儿状态更新为ZOMBIE之后直接重新调度新的进程执行了
   // 子进程的所有东西其实仍然存在，直到父进程调用wait回收已经exit的子进程资源
   p->xstate = status;
   p->state = ZOMBIE;
 
-  release(&original_parent->lock);
+  release(&wait_lock);
 
   // Jump into the scheduler, never to return.
   sched();
@@ -429,62 +1078,60 @@ int
 wait(uint64 addr)
 {
   struct proc *np;
-  int havekids, pid;
+  int havekids, pid, xstate;
   struct proc *p = myproc();
 
-  // hold p->lock for the whole time to avoid lost
+  // hold wait_lock for the whole time to avoid lost
   // wakeups from a child's exit().
-  acquire(&p->lock);
+  acquire(&wait_lock);
 
   for(;;){
-    // Scan through table looking for exited children.
+    // Scan through p's children looking for exited ones.
     havekids = 0;
-    for(np = proc; np < &proc[NPROC]; np++){
-      // this code uses np->parent without holding np->lock.
-      // acquiring the lock first would cause a deadlock,
-      // since np might be an ancestor, and we already hold p->lock.
-      if(np->parent == p){
-        // np->parent can't change between the check and the acquire()
-        // because only the parent changes it, and we're the parent.
-        acquire(&np->lock);
-        havekids = 1;
-        // 找到在当前进程的所有僵尸子进程，然后释放资源；
-        if(np->state == ZOMBIE){
-          // Found one.
-          pid = np->pid;
-          // 从子进程的地址空间中把xstate拷贝出来，这儿wait的参数addr只是一个标志，要不要copyout
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate,
-                                  sizeof(np->xstate)) < 0) {
-            release(&np->lock);
-            release(&p->lock);
-            return -1;
-          }
-          // 把全局数组proc的这一项释放
-          freeproc(np);
-          release(&np->lock);
-          release(&p->lock);
-          // 最后返回值是子进程pid，父进程可以根据这个判断是哪个子进程返回了；
-          return pid;
-        }
+    for(np = p->children; np; np = np->sibnext){
+      acquire(&np->lock);
+      havekids = 1;
+      // 找到在当前进程的所有僵尸子进程，然后释放资源；
+      if(np->state == ZOMBIE){
+        // Found one.
+        pid = np->pid;
+        xstate = np->xstate;
+        *np->sibprev = np->sibnext;
+        if(np->sibnext)
+          np->sibnext->sibprev = np->sibprev;
+        // 把这个proc放回空闲链表
+        freeproc(np);
         release(&np->lock);
+        release(&wait_lock);
+        proctrim();
+        // 从子进程的地址空间中把xstate拷贝出来，这儿wait的参数addr只是一个标志，要不要copyout
+        // 不能在持有自旋锁的时候拷贝：缺页可能要从文件读入，会睡眠。
+        // 拷贝失败的时候子进程也已经回收了。
+        if(addr != 0 && copyout(p->pagetable, addr, (char *)&xstate,
+                                sizeof(xstate)) < 0)
+          return -1;
+        // 最后返回值是子进程pid，父进程可以根据这个判断是哪个子进程返回了；
+        return pid;
       }
+      release(&np->lock);
     }
 
     // No point waiting if we don't have any children.
     if(!havekids || p->killed){
-      release(&p->lock);
+      release(&wait_lock);
       return -1;
     }
     
     // Wait for a child to exit.
-    sleep(p, &p->lock);  //DOC: wait-sleep
+    sleep(p, &wait_lock);  //DOC: wait-sleep
   }
 }
 
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run.
+//  - take a process from this CPU's run queue, or
+//    steal one from another CPU's.
 //  - swtch to start running that process.
 //  - eventually that process transfers control
 //    via swtch back to the scheduler.
@@ -494,55 +1141,80 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int id = cpuid();
   
   c->proc = 0;
   for(;;){
     // Avoid deadlock by giving devices a chance to interrupt.
     intr_on();
+    tlbsync();
 
     // Run the for loop with interrupts off to avoid
     // a race between an interrupt and WFI, which would
     // cause a lost wakeup.
     intr_off();
 
-    // 在qemu中配置的N个hart最终都会在这儿死循环 
-    // 因为上面在main()中已经通过userinit设置过系统第一个进程
-    // 因此scheduler调度器选择的第一个进程也就是initcode这个进程
-    // 
-
-    int found = 0;
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        // 更新选中执行的进程的状态，从RUNNABLE->RUNNING
-        p->state = RUNNING;
-        // 然后把维护当前hart执行的proc是哪个
-        c->proc = p;
-        // 最后直接swtch到选中的进程执行，整个过程仍然都是在supervisor的内核状态下完成
-        // 还是以initcode第一个进程为例子，在allocproc中设置了p->context.ra/sp
-        // 其中ra=forkret，在swtch中把当前hart的ctx保存到c->scheduler
-        // 然后把p->context恢复到hart上，最后调用ret(ra->pc)，也就是在内核中跳转到forkret执行
-        swtch(&c->scheduler, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-
-        found = 1;
-      }
-
-      // ensure that release() doesn't enable interrupts.
-      // again to avoid a race between interrupt and WFI.
-      c->intena = 0;
+    // 先看自己的运行队列，空了就去别的CPU那里偷一个。
+    // 只读一下n来跳过空队列，不去拿它们的锁。
+    p = runqget(&runq[id]);
+    for(int i = 1; p == 0 && i < NCPU; i++){
+      struct runq *q = &runq[(id + i) % NCPU];
+      if(q->n > 0)
+        p = runqget(q);
+    }
+    if(p == 0){
+      // 没有进程可运行：先清零一个空闲页面给kalloc_zeroed()，
+      // 没有要清零的页面了再wfi
+      if(kzerofill() == 0)
+        asm volatile("wfi");
+      continue;
+    }
 
-      release(&p->lock);
+    // p is on no queue now, and stays RUNNABLE until we run it,
+    // but whoever queued it may still hold its lock.
+    // p may have been given a kernel stack that this CPU's
+    // TLB does not know is mapped yet.
+    if(c->kvmgen != kvmgen){
+      c->kvmgen = kvmgen;
+      sfence_vma();
     }
-    if(found == 0){
-      asm volatile("wfi");
+
+    acquire(&p->lock);
+    if(p->state != RUNNABLE)
+      panic("scheduler");
+    // a boost may have come while p waited in the queue.
+    if(p->boost != boostgen){
+      p->boost = boostgen;
+      p->prio = p->baseprio;
+      p->slice = 0;
     }
+
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    // 更新选中执行的进程的状态，从RUNNABLE->RUNNING
+    p->state = RUNNING;
+    // 然后把维护当前hart执行的proc是哪个
+    c->proc = p;
+    // 最后直接swtch到选中的进程执行，整个过程仍然都是在supervisor的内核状态下完成
+    // 还是以initcode第一个进程为例子，在allocproc中设置了p->context.ra/sp
+    // 其中ra=forkret，在swtch中把当前hart的ctx保存到c->scheduler
+    // 然后把p->context恢复到hart上，最后调用ret(ra->pc)，也就是在内核中跳转到forkret执行
+    // 切换到这个进程的内核页表，里面也映射了它的用户内存
+    kvmuse(p);
+    swtch(&c->scheduler, &p->context);
+    // p's page tables may be freed once its lock is released.
+    kvmuse(0);
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+
+    // ensure that release() doesn't enable interrupts.
+    // again to avoid a race between interrupt and WFI.
+    c->intena = 0;
+
+    release(&p->lock);
   }
 }
 
@@ -580,7 +1252,7 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  setrunnable(p);
   sched();
   release(&p->lock);
 }
@@ -615,6 +1287,7 @@ void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct sleepq *q = 0;
   
   // Must acquire p->lock in order to
   // change p->state and then call sched.
@@ -622,8 +1295,21 @@ sleep(void *chan, struct spinlock *lk)
   // guaranteed that we won't miss any wakeup
   // (wakeup locks p->lock),
   // so it's okay to release lk.
+  // wakeup() finds p through chan's sleep queue, so p must be
+  // on it before lk is released; the queue lock comes before
+  // p->lock, as in wakeup().
+  // killthreads()' sleep(p, &p->lock) is only ever ended by
+  // wakeup1() or kill(), which have p in hand, so it is not queued.
   if(lk != &p->lock){  //DOC: sleeplock0
+    q = sqhash(chan);
+    acquire(&q->lock);
+    p->sqnext = q->head;
+    if(q->head)
+      q->head->sqprev = &p->sqnext;
+    q->head = p;
+    p->sqprev = &q->head;
     acquire(&p->lock);  //DOC: sleeplock1
+    release(&q->lock);
     release(lk);
   }
 
@@ -641,6 +1327,14 @@ sleep(void *chan, struct spinlock *lk)
   // Reacquire original lock.
   if(lk != &p->lock){
     release(&p->lock);
+    // off the sleep queue.
+    acquire(&q->lock);
+    *p->sqprev = p->sqnext;
+    if(p->sqnext)
+      p->sqnext->sqprev = p->sqprev;
+    p->sqnext = 0;
+    p->sqprev = 0;
+    release(&q->lock);
     acquire(lk);
   }
 }
@@ -651,18 +1345,22 @@ sleep(void *chan, struct spinlock *lk)
 void
 wakeup(void *chan)
 {
+  struct sleepq *q = sqhash(chan);
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
+  acquire(&q->lock);
+  for(p = q->head; p; p = p->sqnext) {
     acquire(&p->lock);
     if(p->state == SLEEPING && p->chan == chan) {
-      p->state = RUNNABLE;
+      setrunnable(p);
     }
     release(&p->lock);
   }
+  release(&q->lock);
 }
 
-// Wake up p if it is sleeping in wait(); used by exit().
+// Wake up p if it is sleeping in killthreads() (or in wait(),
+// which will look again); used by an exiting thread.
 // Caller must hold p->lock.
 static void
 wakeup1(struct proc *p)
@@ -670,10 +1368,23 @@ wakeup1(struct proc *p)
   if(!holding(&p->lock))
     panic("wakeup1");
   if(p->chan == p && p->state == SLEEPING) {
-    p->state = RUNNABLE;
+    setrunnable(p);
   }
 }
 
+// Wake up p if it is sleeping, whatever it sleeps on; used when
+// p's timer expires. Every sleep() caller re-checks what it waits
+// for, so waking p early is harmless.
+// Must be called without p->lock.
+void
+wakeproc(struct proc *p)
+{
+  acquire(&p->lock);
+  if(p->state == SLEEPING)
+    setrunnable(p);
+  release(&p->lock);
+}
+
 // Kill the process with the given pid.
 // The victim won't exit until it tries to return
 // to user space (see usertrap() in trap.c).
@@ -682,22 +1393,17 @@ kill(int pid)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++){
-    acquire(&p->lock);
-    if(p->pid == pid){
-      // 可以看到，kill其实就是把p->killed设置了，
-      // 对应的处理函数在usertrap中，syscall -> 判断p->killed，如果被killed的话，调用exit(-1)
-      p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
-      }
-      release(&p->lock);
-      return 0;
-    }
-    release(&p->lock);
+  if((p = findproc(pid)) == 0)
+    return -1;
+  // 可以看到，kill其实就是把p->killed设置了，
+  // 对应的处理函数在usertrap中，syscall -> 判断p->killed，如果被killed的话，调用exit(-1)
+  p->killed = 1;
+  if(p->state == SLEEPING){
+    // Wake process from sleep().
+    setrunnable(p);
   }
-  return -1;
+  release(&p->lock);
+  return 0;
 }
 
 // Copy to either a user address, or kernel address,
@@ -732,7 +1438,8 @@ either_copyin(void *dst, int user_src, uint64 src, uint64 len)
 
 // Print a process listing to console.  For debugging.
 // Runs when user types ^P on console.
-// No lock to avoid wedging a stuck machine further.
+// Takes only ptable.lock, which keeps procs from being freed
+// under it, to avoid wedging a stuck machine further.
 void
 procdump(void)
 {
@@ -747,14 +1454,16 @@ procdump(void)
   char *state;
 
   printf("\n");
-  for(p = proc; p < &proc[NPROC]; p++){
+  acquire(&ptable.lock);
+  for(p = ptable.all; p; p = p->allnext){
     if(p->state == UNUSED)
       continue;
     if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
       state = states[p->state];
     else
       state = "???";
-    printf("%d %s %s", p->pid, state, p->name);
+    printf("%d %s %s prio %d rtime %d", p->pid, state, p->name, p->prio, p->rtime);
     printf("\n");
   }
+  release(&ptable.lock);
 }
@@ -24,6 +24,11 @@ struct cpu {
   struct context scheduler;   // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint kvmgen;                // kvmgen at the last TLB flush (see scheduler())
+  uint64 asidgen;             // ASID generation at the last TLB flush (see uvmasid())
+  struct proc *vmgroup;       // Group whose page tables are in use, or null
+  uint tlbreq;                // TLB flushes other CPUs have asked for (see uvmshootdown())
+  uint tlbdone;               // tlbreq at the last such flush
 };
 
 extern struct cpu cpus[NCPU];
@@ -80,6 +85,26 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
+// A file mapped into a process's address space by mmap().
+struct vma {
+  int used;
+  uint64 addr;                 // page-aligned start
+  uint64 len;                  // page-aligned length
+  int prot;                    // PROT_*
+  int flags;                   // MAP_SHARED or MAP_PRIVATE
+  struct file *f;              // holds a reference
+  uint64 off;                  // file offset of addr
+};
+
+// A loadable segment of the program a process runs. Its file
+// data is faulted in from p->exe when first touched; the rest,
+// up to the segment's memory size, is zero-filled like the heap.
+struct seg {
+  uint64 va;                   // page-aligned start
+  uint64 off;                  // file offset of va
+  uint64 filesz;               // bytes of file data
+};
+
 enum procstate { UNUSED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
@@ -88,19 +113,69 @@ struct proc {
 
   // p->lock must be held when using these:
   enum procstate state;        // Process state
-  struct proc *parent;         // Parent process
   void *chan;                  // If non-zero, sleeping on chan
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int nthread;                 // Group leader: other threads not yet exited
+  int baseprio;                // Priority set by setpriority()
+  int prio;                    // Current run queue level, 0 is highest
+  int slice;                   // Ticks run at this level
+  uint boost;                  // boostgen when prio was last reset
+  uint rtime;                  // Ticks run in total
+  struct proc *rqnext;         // Next on run queue (runq lock)
+  struct proc *sqnext;         // Next on sleep queue (sleepq lock)
+  struct proc **sqprev;        // Link pointing at p, 0 if on no sleep queue
+
+  // tickslock must be held when using these:
+  uint deadline;               // Tick at which the armed timer wakes p
+  struct proc *tnext;          // Next in timer wheel slot
+  struct proc **tprev;         // Link pointing at p, 0 if timer not armed
+
+  // wait_lock must be held when using these:
+  struct proc *parent;         // Parent process
+  struct proc *children;       // First child
+  struct proc *sibnext;        // Next child of parent
+  struct proc **sibprev;       // Link pointing at p in parent's list
+
+  // pidhash bucket lock: next in pidhash chain.
+  // pfree lock: next on a CPU's free list.
+  struct proc *pidnext;
+  struct proc *freenext;
+
+  // ptable.lock: next in ptable.all.
+  struct proc *allnext;
+
+  // set once, when the proc is made (see procgrow()):
+  int slot;                    // Index of kernel stack (and thread trapframe)
+
+  int findref;                 // findproc() calls about to take p->lock (atomic)
+
+  // A thread (see clone()) shares its group leader's page table,
+  // memory, mmap()ed areas and open files: sz, vma[], seg[] and
+  // ofile[] are only used in the leader, under its glock where threads
+  // may race. For an ordinary process, group is p itself.
+  struct proc *group;          // Thread group leader
+  struct spinlock glock;       // Group leader: see above
+  pagetable_t kpagetable;      // Kernel page table, the group's (see kvmcreate())
+
+  // asid_lock must be held when using these, in the group leader:
+  uint64 asid;                 // ASID generation<<16 | ASID, 0 if none yet
+  int asidcpu;                 // CPU that last ran the page table
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
+  uint64 tfva;                 // Where tf is mapped in the page table
   uint64 sz;                   // Size of process memory (bytes)
   pagetable_t pagetable;       // Page table
   struct trapframe *tf;        // data page for trampoline.S
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
+  struct vma vma[NVMA];        // mmap()ed files
+  struct inode *exe;           // Program file, for seg[]
+  struct seg seg[NSEG];        // Program's segments (see exec.c)
+  int nseg;
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
+  int nofilefault;             // Fail faults that would read a file (see fileread())
 };
@@ -0,0 +1,213 @@
+//
+// Object caches for kernel structures (files, pipes, inodes,
+// bufs, procs), so that their tables can grow as needed
+// without each object taking a whole page.
+//
+// A cache hands out objects of one size. It carves them out of
+// slabs, blocks from the buddy allocator (buddy.c) big enough
+// for several objects, with a struct slab at the front. A slab
+// is aligned to its size, so kcachefree() finds an object's
+// slab by rounding its address down.
+//
+// Each CPU keeps a magazine of free objects per cache, so most
+// kcachealloc()/kcachefree() calls take no lock at all. Objects
+// move between the magazines and the slabs MAGSIZE/2 at a time,
+// under the cache's lock.
+//
+// The buddy allocator only has BDSIZE bytes (see memlayout.h),
+// so it is kept for the caches whose slabs are bigger than a
+// page: caches with page-sized slabs take pages from kalloc(),
+// and only fall back on the buddy allocator when kalloc() has
+// none.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define NKCACHE  8      // number of caches
+#define MAGSIZE  16     // objects in a per-CPU magazine
+#define MAXSLAB  (16*PGSIZE)
+
+// 放在每个slab开头的头部
+struct slab {
+  struct list link;     // on the cache's partial list, unless full
+  struct kcache *cache;
+  void *free;           // free objects, linked through their first word
+  int inuse;            // objects handed out
+  int paged;            // came from kalloc(), not bd_malloc()
+};
+
+struct magazine {
+  int n;
+  void *obj[MAGSIZE];
+};
+
+struct kcache {
+  struct spinlock lock;
+  char *name;
+  uint size;            // object size, a multiple of 8
+  uint slabsize;        // a power of two, at least PGSIZE
+  struct list partial;  // slabs with free objects
+  int nslab;
+  struct magazine mag[NCPU];
+};
+
+static struct kcache kcaches[NKCACHE];
+static int nkcache;
+
+#define SLABHDR  ((sizeof(struct slab) + 7) & ~7L)
+#define SLABOF(c, obj)  ((struct slab*)((uint64)(obj) & ~((uint64)(c)->slabsize - 1)))
+
+void
+slabinit(void)
+{
+  // hand the top BDSIZE bytes of RAM to the buddy allocator;
+  // kinit() leaves them out of the page allocator.
+  bd_init((void*)(PHYSTOP - BDSIZE), (void*)PHYSTOP);
+}
+
+// Make a cache of objects of size bytes. Only called while
+// booting, on one CPU.
+struct kcache*
+kcachecreate(char *name, uint size)
+{
+  struct kcache *c;
+  uint waste;
+
+  if(nkcache >= NKCACHE)
+    panic("kcachecreate");
+  c = &kcaches[nkcache++];
+  initlock(&c->lock, name);
+  c->name = name;
+  c->size = (size + 7) & ~7;
+  lst_init(&c->partial);
+
+  // the smallest slab that wastes no more than an eighth of itself.
+  c->slabsize = PGSIZE;
+  for(;;){
+    if(c->slabsize - SLABHDR >= c->size){
+      waste = (c->slabsize - SLABHDR) % c->size;
+      if(waste <= c->slabsize / 8 || c->slabsize >= MAXSLAB)
+        break;
+    } else if(c->slabsize >= MAXSLAB){
+      panic("kcachecreate: too big");
+    }
+    c->slabsize *= 2;
+  }
+  return c;
+}
+
+// Make a new slab for c and put it on c's partial list.
+// Caller holds c->lock.
+static struct slab*
+slabgrow(struct kcache *c)
+{
+  struct slab *s;
+  char *obj;
+  int paged = 0;
+
+  if(c->slabsize == PGSIZE && (s = kalloc()) != 0)
+    paged = 1;
+  else if((s = bd_malloc(c->slabsize)) == 0)
+    return 0;
+  s->cache = c;
+  s->inuse = 0;
+  s->paged = paged;
+  s->free = 0;
+  for(obj = (char*)s + SLABHDR; obj + c->size <= (char*)s + c->slabsize; obj += c->size){
+    *(void**)obj = s->free;
+    s->free = obj;
+  }
+  lst_push(&c->partial, s);
+  c->nslab++;
+  return s;
+}
+
+// Take one object from c's slabs. Caller holds c->lock.
+static void*
+slabget(struct kcache *c)
+{
+  struct slab *s;
+  void *obj;
+
+  if(lst_empty(&c->partial) && slabgrow(c) == 0)
+    return 0;
+  s = (struct slab*)c->partial.next;
+  obj = s->free;
+  s->free = *(void**)obj;
+  s->inuse++;
+  if(s->free == 0)
+    lst_remove(&s->link);   // full; off the partial list
+  return obj;
+}
+
+// Give obj back to its slab, and the slab back to the buddy
+// allocator if it is now empty and not c's last one.
+// Caller holds c->lock.
+static void
+slabput(struct kcache *c, void *obj)
+{
+  struct slab *s = SLABOF(c, obj);
+
+  if(s->cache != c)
+    panic("kcachefree: wrong cache");
+  if(s->free == 0)
+    lst_push(&c->partial, s);
+  *(void**)obj = s->free;
+  s->free = obj;
+  if(--s->inuse == 0 && c->nslab > 1){
+    lst_remove(&s->link);
+    c->nslab--;
+    if(s->paged)
+      kfree(s);
+    else
+      bd_free(s);
+  }
+}
+
+// Allocate an object from c. Its contents are whatever the
+// last user left. Returns 0 if out of memory.
+void*
+kcachealloc(struct kcache *c)
+{
+  struct magazine *m;
+  void *obj;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == 0){
+    // 本CPU的弹匣空了，从slab里补半匣
+    acquire(&c->lock);
+    while(m->n < MAGSIZE/2 && (obj = slabget(c)) != 0)
+      m->obj[m->n++] = obj;
+    release(&c->lock);
+  }
+  obj = 0;
+  if(m->n > 0)
+    obj = m->obj[--m->n];
+  pop_off();
+  return obj;
+}
+
+// Free an object allocated from c.
+void
+kcachefree(struct kcache *c, void *obj)
+{
+  struct magazine *m;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == MAGSIZE){
+    // 弹匣满了，还半匣给slab
+    acquire(&c->lock);
+    while(m->n > MAGSIZE/2)
+      slabput(c, m->obj[--m->n]);
+    release(&c->lock);
+  }
+  m->obj[m->n++] = obj;
+  pop_off();
+}
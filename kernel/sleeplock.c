@@ -18,6 +18,16 @@ initsleeplock(struct sleeplock *lk, char *name)
   lk->pid = 0;
 }
 
+// as initobjlock(), for a sleep lock in an object from a kcache.
+void
+initobjsleeplock(struct sleeplock *lk, char *name)
+{
+  initobjlock(&lk->lk, "sleep lock");
+  lk->name = name;
+  lk->locked = 0;
+  lk->pid = 0;
+}
+
 void
 acquiresleep(struct sleeplock *lk)
 {
@@ -30,6 +40,23 @@ acquiresleep(struct sleeplock *lk)
   release(&lk->lk);
 }
 
+// Acquire lk if no one holds it, without sleeping.
+// Returns 1 if it did, 0 if not.
+int
+tryacquiresleep(struct sleeplock *lk)
+{
+  int r = 0;
+
+  acquire(&lk->lk);
+  if(!lk->locked){
+    lk->locked = 1;
+    lk->pid = myproc()->pid;
+    r = 1;
+  }
+  release(&lk->lk);
+  return r;
+}
+
 void
 releasesleep(struct sleeplock *lk)
 {
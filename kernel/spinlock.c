@@ -13,19 +13,30 @@
 static int nlock;
 static struct spinlock *locks[NLOCK];
 
+// Initialize a lock that lives for good, and list it in locks[]
+// for sys_ntas()'s statistics.
 // assumes locks are not freed
 void
 initlock(struct spinlock *lk, char *name)
+{
+  initobjlock(lk, name);
+  if(nlock >= NLOCK)
+    panic("initlock");
+  locks[nlock] = lk;
+  nlock++;
+}
+
+// Initialize a lock in an object from a kcache (a proc, buf,
+// inode or pipe). There can be any number of those, and they
+// may be freed, so the lock is left out of locks[].
+void
+initobjlock(struct spinlock *lk, char *name)
 {
   lk->name = name;
   lk->locked = 0;
   lk->cpu = 0;
   lk->nts = 0;
   lk->n = 0;
-  if(nlock >= NLOCK)
-    panic("initlock");
-  locks[nlock] = lk;
-  nlock++;
 }
 
 // Acquire the lock.
@@ -45,6 +56,9 @@ acquire(struct spinlock *lk)
   //   amoswap.w.aq a5, a5, (s1)
   while(__sync_lock_test_and_set(&lk->locked, 1) != 0) {
      __sync_fetch_and_add(&lk->nts, 1);
+     // the holder may be waiting for this CPU to flush its TLB.
+     if(*(volatile uint*)&mycpu()->tlbreq != mycpu()->tlbdone)
+       tlbsync();
   }
   
   // Tell the C compiler and the processor to not move loads or stores
@@ -18,38 +18,73 @@
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
+// The file table is shared by the group's threads, and another
+// thread may close fd at any time, so the file comes with a
+// reference of its own: the caller must fileclose() it when done.
 // 根据syscall的参数，得到进程打开文件struct file，其实就是多了myproc()->ofile[xxx]这一步
 static int
 argfd(int n, int *pfd, struct file **pf)
 {
   int fd;
   struct file *f;
+  struct proc *g = myproc()->group;
 
   if(argint(n, &fd) < 0)
     return -1;
-  if(fd < 0 || fd >= NOFILE || (f=myproc()->ofile[fd]) == 0)
+  if(fd < 0 || fd >= NOFILE)
+    return -1;
+  acquire(&g->glock);
+  if((f = g->ofile[fd]) != 0)
+    filedup(f);
+  release(&g->glock);
+  if(f == 0)
     return -1;
   if(pfd)
     *pfd = fd;
   if(pf)
     *pf = f;
+  else
+    fileclose(f);
   return 0;
 }
 
+// Take fd out of the file table and return its file, with the
+// table's reference, or return 0 if fd is not open. If f is
+// not 0, fd is only taken if it still refers to f.
+static struct file*
+fdtake(int fd, struct file *f)
+{
+  struct proc *g = myproc()->group;
+  struct file *ff;
+
+  acquire(&g->glock);
+  ff = g->ofile[fd];
+  if(ff && (f == 0 || ff == f))
+    g->ofile[fd] = 0;
+  else
+    ff = 0;
+  release(&g->glock);
+  return ff;
+}
+
 // Allocate a file descriptor for the given file.
 // Takes over file reference from caller on success.
 static int
 fdalloc(struct file *f)
 {
   int fd;
-  struct proc *p = myproc();
+  struct proc *g = myproc()->group;
 
+  // the table is shared by g's threads.
+  acquire(&g->glock);
   for(fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd] == 0){
-      p->ofile[fd] = f;
+    if(g->ofile[fd] == 0){
+      g->ofile[fd] = f;
+      release(&g->glock);
       return fd;
     }
   }
+  release(&g->glock);
   return -1;
 }
 
@@ -59,13 +94,14 @@ sys_dup(void)
   struct file *f;
   int fd;
 
-  // 首先找到这个打开文件f
+  // 首先找到这个打开文件f，argfd()已经给了一个引用计数
   if(argfd(0, 0, &f) < 0)
     return -1;
-  // 然后根据这个发，再次打开一遍，计数ref++
-  if((fd=fdalloc(f)) < 0)
+  // 然后把这个引用交给新的fd
+  if((fd=fdalloc(f)) < 0){
+    fileclose(f);
     return -1;
-  filedup(f);
+  }
   return fd;
 }
 
@@ -73,25 +109,29 @@ uint64
 sys_read(void)
 {
   struct file *f;
-  int n;
+  int n, r;
   uint64 p;
 
-  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argaddr(1, &p) < 0)
+  if(argint(2, &n) < 0 || argaddr(1, &p) < 0 || argfd(0, 0, &f) < 0)
     return -1;
-  return fileread(f, p, n);
+  r = fileread(f, p, n);
+  fileclose(f);
+  return r;
 }
 
 uint64
 sys_write(void)
 {
   struct file *f;
-  int n;
+  int n, r;
   uint64 p;
 
-  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argaddr(1, &p) < 0)
+  if(argint(2, &n) < 0 || argaddr(1, &p) < 0 || argfd(0, 0, &f) < 0)
     return -1;
 
-  return filewrite(f, p, n);
+  r = filewrite(f, p, n);
+  fileclose(f);
+  return r;
 }
 
 // 关闭系统打开文件
@@ -101,10 +141,12 @@ sys_close(void)
   int fd;
   struct file *f;
 
-  if(argfd(0, &fd, &f) < 0)
+  if(argint(0, &fd) < 0 || fd < 0 || fd >= NOFILE)
+    return -1;
+  // 在glock下把struct的打开文件数组的这一项清0，
+  // 这样两个线程同时close同一个fd，只有一个能拿到f
+  if((f = fdtake(fd, 0)) == 0)
     return -1;
-  // 把struct的打开文件数组的这一项清0
-  myproc()->ofile[fd] = 0;
   // 然后关闭这个文件，这个有引用计数
   fileclose(f);
   return 0;
@@ -115,10 +157,13 @@ sys_fstat(void)
 {
   struct file *f;
   uint64 st; // user pointer to struct stat
+  int r;
 
-  if(argfd(0, 0, &f) < 0 || argaddr(1, &st) < 0)
+  if(argaddr(1, &st) < 0 || argfd(0, 0, &f) < 0)
     return -1;
-  return filestat(f, st);
+  r = filestat(f, st);
+  fileclose(f);
+  return r;
 }
 
 // Create the path new as a link to the same inode as old.
@@ -350,6 +395,9 @@ sys_open(void)
   }
   f->ip = ip;
   f->off = 0;
+  f->ranext = 0;
+  f->raend = 0;
+  f->rawin = 0;
   f->readable = !(omode & O_WRONLY);
   f->writable = (omode & O_WRONLY) || (omode & O_RDWR);
 
@@ -502,20 +550,65 @@ sys_pipe(void)
     return -1;
   fd0 = -1;
   if((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0){
-    if(fd0 >= 0)
-      p->ofile[fd0] = 0;
-    fileclose(rf);
+    // another thread may have closed fd0 already.
+    if(fd0 < 0 || fdtake(fd0, rf) != 0)
+      fileclose(rf);
     fileclose(wf);
     return -1;
   }
   if(copyout(p->pagetable, fdarray, (char*)&fd0, sizeof(fd0)) < 0 ||
      copyout(p->pagetable, fdarray+sizeof(fd0), (char *)&fd1, sizeof(fd1)) < 0){
-    p->ofile[fd0] = 0;
-    p->ofile[fd1] = 0;
-    fileclose(rf);
-    fileclose(wf);
+    if(fdtake(fd0, rf) != 0)
+      fileclose(rf);
+    if(fdtake(fd1, wf) != 0)
+      fileclose(wf);
     return -1;
   }
   return 0;
 }
 
+
+uint64
+sys_mmap(void)
+{
+  uint64 addr;
+  int len, prot, flags, off;
+  struct file *f;
+  uint64 r = -1;
+
+  // addr is only a hint, and the kernel always chooses.
+  if(argaddr(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &prot) < 0 ||
+     argint(3, &flags) < 0 || argint(5, &off) < 0 || argfd(4, 0, &f) < 0)
+    return -1;
+  if(len <= 0 || off < 0 || off % PGSIZE != 0)
+    goto out;
+  if(flags != MAP_SHARED && flags != MAP_PRIVATE)
+    goto out;
+  if(f->type != FD_INODE)
+    goto out;
+  // every mapping reads the file in, and is readable (see
+  // vmafault()); a page with no access at all is not supported.
+  if(prot == 0 || (prot & ~(PROT_READ|PROT_WRITE|PROT_EXEC)) != 0)
+    goto out;
+  if(!f->readable)
+    goto out;
+  // private mappings never write to the file.
+  if(flags == MAP_SHARED && (prot & PROT_WRITE) && !f->writable)
+    goto out;
+  // the mapping takes a reference of its own.
+  r = vmamap(f, len, prot, flags, off);
+out:
+  fileclose(f);
+  return r;
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr;
+  int len;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &len) < 0 || len <= 0)
+    return -1;
+  return vmaunmap(myproc()->group, addr, len);
+}
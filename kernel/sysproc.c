@@ -6,6 +6,7 @@
 #include "memlayout.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "futex.h"
 
 uint64
 sys_exit(void)
@@ -41,13 +42,13 @@ sys_wait(void)
 uint64
 sys_sbrk(void)
 {
-  int addr;
+  uint64 addr;
   int n;
 
   if(argint(0, &n) < 0)
     return -1;
-  addr = myproc()->sz;
-  if(growproc(n) < 0)
+  // the old size, read under glock by growproc().
+  if((addr = growproc(n)) == -1)
     return -1;
   return addr;
 }
@@ -57,23 +58,27 @@ sys_sleep(void)
 {
   int n;
   uint ticks0;
+  struct proc *p = myproc();
 
   if(argint(0, &n) < 0)
     return -1;
   acquire(&tickslock);
   // ticks0先把当前ticks记住
   ticks0 = ticks;
-  // 分析完sleep和walkup，知道每次定时器中断都会唤醒进程
-  // 进程被唤醒之后被调度到的时候，会到这儿，在while中判断当前ticks和ticks0
-  // 继续sleep。所以usermode中sleep时长其实是在这个循环实现的
+  // 定时器在ticks0+n到期时唤醒这个进程，中间的定时器中断不会打扰它。
+  // 被唤醒之后还是在while中判断当前ticks和ticks0，
+  // 被kill或者别的原因提前醒来也没关系
+  if(n > 0)
+    settimer(p, ticks0 + n);
   while(ticks - ticks0 < n){
-    if(myproc()->killed){
+    if(p->killed){
+      canceltimer(p);
       release(&tickslock);
       return -1;
     }
-    // sleep在固定的chan，也就是&ticks
-    sleep(&ticks, &tickslock);
+    sleep(&p->deadline, &tickslock);
   }
+  canceltimer(p);
   release(&tickslock);
   return 0;
 }
@@ -88,6 +93,43 @@ sys_kill(void)
   return kill(pid);
 }
 
+uint64
+sys_setpriority(void)
+{
+  int pid, prio;
+
+  if(argint(0, &pid) < 0 || argint(1, &prio) < 0)
+    return -1;
+  return setpriority(pid, prio);
+}
+
+uint64
+sys_clone(void)
+{
+  uint64 fn, arg, stack;
+
+  if(argaddr(0, &fn) < 0 || argaddr(1, &arg) < 0 || argaddr(2, &stack) < 0)
+    return -1;
+  return clone(fn, arg, stack);
+}
+
+uint64
+sys_futex(void)
+{
+  uint64 addr;
+  int op, val;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &op) < 0 || argint(2, &val) < 0)
+    return -1;
+  switch(op){
+  case FUTEX_WAIT:
+    return futexwait(addr, val);
+  case FUTEX_WAKE:
+    return futexwake(addr);
+  }
+  return -1;
+}
+
 // return how many clock tick interrupts have occurred
 // since start.
 uint64
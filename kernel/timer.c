@@ -0,0 +1,133 @@
+//
+// Per-process timers, kept in a hierarchical timer wheel.
+//
+// A process arms its timer with settimer(p, deadline) and then
+// sleeps; when ticks reaches the deadline, timertick() (called
+// from clockintr()) wakes it. Only the processes whose deadline
+// has come are woken, instead of every sleeper on every tick.
+//
+// The wheel has NLEVEL levels of WHEELSIZE slots. A timer due
+// within WHEELSIZE ticks sits in a level 0 slot, one per tick;
+// one due later sits in a higher level, whose slots each cover
+// WHEELSIZE times as many ticks as the level below. Whenever the
+// level below wraps around, the next slot of a level is emptied
+// and its timers are put back in the wheel, now closer to their
+// deadlines.
+//
+// The wheel and p->deadline, p->tnext, p->tprev are protected
+// by tickslock.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "proc.h"
+
+#define WHEELBITS 6
+#define WHEELSIZE (1 << WHEELBITS)
+#define WHEELMASK (WHEELSIZE - 1)
+#define NLEVEL 4
+// furthest deadline the wheel can hold; later ones wait in the
+// last slot and are re-filed when it is emptied.
+#define MAXWAIT ((1 << (NLEVEL*WHEELBITS)) - 1)
+
+struct proc *wheel[NLEVEL][WHEELSIZE];
+uint wheeltime;  // next tick whose level 0 slot timertick() will run
+
+// put p in the slot for p->deadline.
+static void
+enqueue(struct proc *p)
+{
+  uint d = p->deadline - wheeltime;
+  uint when = p->deadline;
+  struct proc **slot;
+  int lvl;
+
+  if((int)d < 0){
+    // already due; run at the next tick.
+    d = 0;
+    when = wheeltime;
+  } else if(d > MAXWAIT){
+    d = MAXWAIT;
+    when = wheeltime + MAXWAIT;
+  }
+  for(lvl = 0; lvl < NLEVEL-1; lvl++)
+    if(d < (1 << ((lvl+1)*WHEELBITS)))
+      break;
+  slot = &wheel[lvl][(when >> (lvl*WHEELBITS)) & WHEELMASK];
+
+  p->tnext = *slot;
+  if(*slot)
+    (*slot)->tprev = &p->tnext;
+  *slot = p;
+  p->tprev = slot;
+}
+
+// re-file the timers in slot i of level lvl.
+static void
+cascade(int lvl, int i)
+{
+  struct proc *p, *next;
+
+  p = wheel[lvl][i];
+  wheel[lvl][i] = 0;
+  for(; p; p = next){
+    next = p->tnext;
+    enqueue(p);
+  }
+}
+
+// Arm p's timer to wake it once ticks reaches deadline,
+// replacing any earlier one. Caller holds tickslock.
+void
+settimer(struct proc *p, uint deadline)
+{
+  canceltimer(p);
+  p->deadline = deadline;
+  enqueue(p);
+}
+
+// Disarm p's timer, if it is armed. Caller holds tickslock.
+void
+canceltimer(struct proc *p)
+{
+  if(p->tprev == 0)
+    return;
+  *p->tprev = p->tnext;
+  if(p->tnext)
+    p->tnext->tprev = p->tprev;
+  p->tnext = 0;
+  p->tprev = 0;
+}
+
+// Wake the processes whose deadlines have come.
+// Called by clockintr() with tickslock held, after ticks++.
+void
+timertick(void)
+{
+  struct proc *p, *next;
+  int lvl, i;
+
+  while((int)(ticks - wheeltime) >= 0){
+    i = wheeltime & WHEELMASK;
+    // level lvl-1 has wrapped around, so level lvl's next
+    // slot is now within its reach.
+    for(lvl = 1; lvl < NLEVEL; lvl++){
+      if(((wheeltime >> ((lvl-1)*WHEELBITS)) & WHEELMASK) != 0)
+        break;
+      cascade(lvl, (wheeltime >> (lvl*WHEELBITS)) & WHEELMASK);
+    }
+
+    p = wheel[0][i];
+    wheel[0][i] = 0;
+    wheeltime++;
+    for(; p; p = next){
+      next = p->tnext;
+      p->tnext = 0;
+      p->tprev = 0;
+      wakeproc(p);
+    }
+  }
+}
@@ -10,6 +10,7 @@ struct spinlock tickslock;
 uint ticks;
 
 extern char trampoline[], uservec[], userret[];
+extern char copyuser_fault[], copyuser_end[];  // copyuser.S
 
 // in kernelvec.S, calls kerneltrap().
 void kernelvec();
@@ -25,6 +26,17 @@ trapinit(void)
   initlock(&tickslock, "time");
 }
 
+// the access a page fault's scause is for, as vmfault() wants it.
+static int
+faultaccess(uint64 scause)
+{
+  if(scause == 12)
+    return PTE_X;
+  if(scause == 15)
+    return PTE_W;
+  return PTE_R;
+}
+
 // set up to take exceptions and traps while in the kernel.
 void
 trapinithart(void)
@@ -77,6 +89,13 @@ usertrap(void)
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
+  } else if((r_scause() == 12 || r_scause() == 13 || r_scause() == 15) &&
+            vmfault(p->pagetable, r_stval(), faultaccess(r_scause())) != 0){
+    // fetch, load or store to a lazily allocated heap page or a
+    // page of the program not yet read in, or a store to a
+    // copy-on-write page; it is now mapped as the access needs.
+    // the TLB may still hold the old PTE.
+    uvmflush(p->pagetable, r_stval());
   } else {
     printf("usertrap(): unexpected scause %p (%s) pid=%d\n", r_scause(), scause_desc(r_scause()), p->pid);
     printf("            sepc=%p stval=%p\n", r_sepc(), r_stval());
@@ -86,8 +105,9 @@ usertrap(void)
   if(p->killed)
     exit(-1);
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2)
+  // give up the CPU if this is a timer interrupt
+  // and the process's quantum is used up.
+  if(which_dev == 2 && proctick())
     yield();
 
   // 最后从内核继续返回到user mode
@@ -118,8 +138,13 @@ usertrapret(void)
   // set up trapframe values that uservec will need when
   // the process next re-enters the kernel.
   // 把当前内核的上下文保护起来
-  // 内核页表的基地址
-  p->tf->kernel_satp = r_satp();         // kernel page table
+  // 内核页表的基地址，是进程自己的内核页表，见kvmcreate()
+  uint64 asid = uvmasid(p->group);
+  p->tf->kernel_satp = MAKE_SATP(p->kpagetable, KASID(asid));
+  // uvmasid() may have given the process a new ASID; stop
+  // making TLB entries under the old one.
+  if(r_satp() != p->tf->kernel_satp)
+    w_satp(p->tf->kernel_satp);
   // 进程内核栈
   p->tf->kernel_sp = p->kstack + PGSIZE; // process's kernel stack
   // 用户态进程陷入内核之后的处理函数，设置为usertrap
@@ -146,7 +171,8 @@ usertrapret(void)
 
   // tell trampoline.S the user page table to switch to.
   // 这个satp就是用户进程自己的页表基地址
-  uint64 satp = MAKE_SATP(p->pagetable);
+  // 带上ASID，这样userret就不用刷掉整个TLB
+  uint64 satp = MAKE_SATP(p->pagetable, UASID(asid));
 
   // jump to trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
@@ -164,7 +190,8 @@ usertrapret(void)
   // 在fn中，也就是userret中load的其实也就是epc和sp，在userret的最后调用sret，将epc->pc，sstatus寄存器的SPP恢复
   // initcode也就正式进入用户态执行了
   // 注意在fn函数内部，先设置好satp寄存器，表示使用用户进程的页表，所以TRAPFRAME这个地址是相对进程页表来说的
-  ((void (*)(uint64,uint64))fn)(TRAPFRAME, satp);
+  // 线程的trapframe不在TRAPFRAME，而是在p->tfva，见clone()
+  ((void (*)(uint64,uint64))fn)(p->tfva, satp);
 }
 
 // interrupts and exceptions from kernel code go here via kernelvec,
@@ -182,6 +209,24 @@ kerneltrap()
   if(intr_get() != 0)
     panic("kerneltrap: interrupts enabled");
 
+  if((scause == 13 || scause == 15) &&
+     sepc >= (uint64)copyuser && sepc < (uint64)copyuser_end){
+    // a page fault on a user address in copyin() or copyout():
+    // fault the page in as usertrap() would and try again,
+    // or make the copy fail.
+    // SUM stays clear meanwhile: vmfault() may sleep reading
+    // the page in, and another process could run on this CPU.
+    struct proc *p = myproc();
+    w_sstatus(sstatus & ~SSTATUS_SUM);
+    if(vmfault(p->pagetable, r_stval(), faultaccess(scause)) != 0)
+      uvmflush(p->pagetable, r_stval());
+    else
+      sepc = (uint64)copyuser_fault;
+    w_sepc(sepc);
+    w_sstatus(sstatus);
+    return;
+  }
+
   // 检查是哪一个设备中断，然后处理，得到which_dev
   if((which_dev = devintr()) == 0){
     printf("scause %p (%s)\n", scause, scause_desc(scause));
@@ -191,7 +236,8 @@ kerneltrap()
 
   // give up the CPU if this is a timer interrupt.
   // 根据devintr，which_dev==2的情况只有一种，就是定时器中断
-  if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING)
+  if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING &&
+     proctick())
     yield();
 
   // the yield() may have caused some traps to occur,
@@ -210,9 +256,13 @@ clockintr()
   // 这是啥意思呢？既然这样怎么区分sleep(5)，sleep(10)呢？
   // sleep，wakeup的chan都是同一个地址，那岂不是每次定时器中断都会把所有sleep的唤醒
   // 这是一种简单的做法，再回去看sys_sleep
+  // 现在sys_sleep不再都sleep在&ticks上了，每个进程有自己的定时器，
+  // timertick只唤醒到期的进程，见timer.c
   acquire(&tickslock);
   ticks++;
-  wakeup(&ticks);
+  timertick();
+  if(ticks % BOOSTTICKS == 0)
+    prioboost();
   release(&tickslock);
 }
 
@@ -254,6 +304,8 @@ devintr()
       // 定时器中断
       clockintr();
     }
+    // another CPU may be waiting for this one to flush its TLB.
+    tlbsync();
     
     // acknowledge the software interrupt by clearing
     // the SSIP bit in sip.
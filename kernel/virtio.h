@@ -44,8 +44,9 @@
 #define VIRTIO_RING_F_EVENT_IDX     29
 
 // this many virtio descriptors.
-// must be a power of two.
-#define NUM 8
+// must be a power of two, and small enough that the
+// descriptors and the avail ring fit in one page.
+#define NUM 64
 
 struct VRingDesc {
   uint64 addr;
@@ -20,6 +20,13 @@
 // the address of virtio mmio register r.
 #define R(n, r) ((volatile uint32 *)(VIRTION(n) + (r)))
 
+// the first descriptor of each request points to one of these.
+struct virtio_blk_outhdr {
+  uint32 type;
+  uint32 reserved;
+  uint64 sector;
+};
+
 struct disk {
   // memory for virtio descriptors &c for queue 0.
   // this is a global instead of allocated because it has
@@ -43,6 +50,11 @@ struct disk {
     char status;
   } info[NUM];
 
+  // request headers, also indexed by first descriptor.
+  // they live here rather than on the submitter's stack
+  // because the submitter need not wait for the request.
+  struct virtio_blk_outhdr ops[NUM];
+
   // initialized?
   int init;
 
@@ -177,13 +189,15 @@ alloc3_desc(int n, int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(int n, struct buf *b, int write)
+// Add a request for b to the avail ring, without telling the
+// device. If no descriptors are free, notify the device of the
+// requests queued so far and wait for some to complete.
+// Caller holds vdisk_lock.
+static void
+virtio_disk_queue(int n, struct buf *b, int write)
 {
   uint64 sector = b->blockno * (BSIZE / 512);
 
-  acquire(&disk[n].vdisk_lock);
-
   // the spec says that legacy block operations use three
   // descriptors: one for type/reserved/sector, one for
   // the data, one for a 1-byte status result.
@@ -194,29 +208,24 @@ virtio_disk_rw(int n, struct buf *b, int write)
     if(alloc3_desc(n, idx) == 0) {
       break;
     }
+    *R(n, VIRTIO_MMIO_QUEUE_NOTIFY) = 0;
     sleep(&disk[n].free[0], &disk[n].vdisk_lock);
   }
   
   // format the three descriptors.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_outhdr {
-    uint32 type;
-    uint32 reserved;
-    uint64 sector;
-  } buf0;
+  struct virtio_blk_outhdr *buf0 = &disk[n].ops[idx[0]];
 
   if(write)
-    buf0.type = VIRTIO_BLK_T_OUT; // write the disk
+    buf0->type = VIRTIO_BLK_T_OUT; // write the disk
   else
-    buf0.type = VIRTIO_BLK_T_IN; // read the disk
-  buf0.reserved = 0;
-  buf0.sector = sector;
-
-  // buf0 is on a kernel stack, which is not direct mapped,
-  // thus the call to kvmpa().
-  disk[n].desc[idx[0]].addr = (uint64) kvmpa((uint64) &buf0);
-  disk[n].desc[idx[0]].len = sizeof(buf0);
+    buf0->type = VIRTIO_BLK_T_IN; // read the disk
+  buf0->reserved = 0;
+  buf0->sector = sector;
+
+  disk[n].desc[idx[0]].addr = (uint64) buf0;
+  disk[n].desc[idx[0]].len = sizeof(*buf0);
   disk[n].desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk[n].desc[idx[0]].next = idx[1];
 
@@ -246,20 +255,42 @@ virtio_disk_rw(int n, struct buf *b, int write)
   disk[n].avail[2 + (disk[n].avail[1] % NUM)] = idx[0];
   __sync_synchronize();
   disk[n].avail[1] = disk[n].avail[1] + 1;
+}
 
+// Start reading or writing bufs b[0..nb-1], which the caller
+// has locked, notifying the device once for the whole batch.
+// Does not wait; each b[i]->disk is cleared when it completes.
+void
+virtio_disk_start(int n, struct buf **b, int nb, int write)
+{
+  acquire(&disk[n].vdisk_lock);
+  for(int i = 0; i < nb; i++)
+    virtio_disk_queue(n, b[i], write);
   *R(n, VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  release(&disk[n].vdisk_lock);
+}
 
-  // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
-    sleep(b, &disk[n].vdisk_lock);
+// Wait for the requests for bufs b[0..nb-1] to complete.
+void
+virtio_disk_wait(int n, struct buf **b, int nb)
+{
+  acquire(&disk[n].vdisk_lock);
+  for(int i = 0; i < nb; i++){
+    // Wait for virtio_disk_intr() to say request has finished.
+    while(b[i]->disk == 1) {
+      sleep(b[i], &disk[n].vdisk_lock);
+    }
   }
-
-  disk[n].info[idx[0]].b = 0;
-  free_chain(n, idx[0]);
-
   release(&disk[n].vdisk_lock);
 }
 
+void
+virtio_disk_rw(int n, struct buf *b, int write)
+{
+  virtio_disk_start(n, &b, 1, write);
+  virtio_disk_wait(n, &b, 1);
+}
+
 void
 virtio_disk_intr(int n)
 {
@@ -268,11 +299,18 @@ virtio_disk_intr(int n)
   while((disk[n].used_idx % NUM) != (disk[n].used->id % NUM)){
     int id = disk[n].used->elems[disk[n].used_idx].id;
 
+    struct buf *b = disk[n].info[id].b;
+
     if(disk[n].info[id].status != 0)
       panic("virtio_disk_intr status");
     
-    disk[n].info[id].b->disk = 0;   // disk is done with buf
-    wakeup(disk[n].info[id].b);
+    disk[n].info[id].b = 0;
+    free_chain(n, id);
+    b->disk = 0;   // disk is done with buf
+    if(b->async)
+      bdone(b);    // readahead; no one is waiting
+    else
+      wakeup(b);
 
     disk[n].used_idx = (disk[n].used_idx + 1) % NUM;
   }
@@ -5,6 +5,8 @@
 #include "riscv.h"
 #include "defs.h"
 #include "fs.h"
+#include "spinlock.h"
+#include "proc.h"
 
 /*
  * the kernel's page table.
@@ -16,6 +18,42 @@ extern char etext[];  // kernel.ld sets this to end of kernel code.
 extern char trampoline[]; // trampoline.S
 
 void print(pagetable_t);
+static pte_t *walksuper(pagetable_t, uint64, int);
+static int demote(pte_t *);
+static int copyoutwalk(pagetable_t, uint64, char *, uint64);
+static int copyinwalk(pagetable_t, char *, uint64, uint64);
+static int copyinstrwalk(pagetable_t, char *, uint64, uint64);
+static void uvmreap(pagetable_t, uint64, uint64);
+
+// Address space identifiers. Each process is given a number n,
+// and its user and kernel page tables the ASIDs UASID(n) and
+// KASID(n), which tag their entries in the TLB, so that
+// switching page tables need not flush the TLB: a process that
+// runs again finds its entries still there. The kernel's own
+// page table uses ASID 0.
+//
+// Numbers are handed out in order. When they run out, a new
+// generation begins: every process gets a new number when it
+// next runs, and each CPU flushes its whole TLB before it runs
+// one from the new generation.
+int asidbits;             // width of the satp ASID field, 0 if none
+struct spinlock asid_lock;
+uint64 asidgen = 1;       // current generation
+uint64 nextasid = 1;      // next number to hand out in this generation
+
+#define ASIDGEN(a) ((a) >> 16)
+#define ASIDNUM(a) ((a) & SATP_ASIDMASK)
+
+// Each process also has a kernel page table of its own, which
+// the kernel runs on while it works for the process. It is the
+// kernel page table, except that its first two 1GB regions are
+// those of the process's user page table, shared whole at the
+// top level, so that the kernel can reach user memory at user
+// addresses: copyin() and copyout() copy directly (see
+// copyuser.S) instead of walking the page table page by page.
+// The user heap and the mmap() area live in these regions (see
+// memlayout.h). The kernel's device registers live in the first
+// one too, so every user page table maps them, without PTE_U.
 
 /*
  * create a direct-map page table for the kernel and
@@ -28,6 +66,8 @@ void print(pagetable_t);
 void
 kvminit()
 {
+  initlock(&asid_lock, "asid");
+
   // 申请一页作为内核页表
   kernel_pagetable = (pagetable_t) kalloc();
   // 初始化内核页表
@@ -48,9 +88,8 @@ kvminit()
   // 0x10002000L
   kvmmap(VIRTION(1), VIRTION(1), PGSIZE, PTE_R | PTE_W);
 
-  // CLINT
-  // 0x2000000L
-  kvmmap(CLINT, CLINT, 0x10000, PTE_R | PTE_W);
+  // CLINT只在machine mode下用(timervec)，那时不分页，所以不映射；
+  // 它在0x2000000L，在用户堆的范围里面，见memlayout.h
 
   // PLIC
   // 0x0c000000L
@@ -68,6 +107,7 @@ kvminit()
 
   // map kernel data and the physical RAM we'll make use of.
   // 和上面一样，此处映射的是[etext, PHYSTOP]这段区域，这段属于数据区，可读可写，不能执行
+  // mappages()在2MB对齐的地方会用大页，所以RAM的大部分只用level-1的PTE映射
   kvmmap((uint64)etext, (uint64)etext, PHYSTOP-(uint64)etext, PTE_R | PTE_W);
 
   // map the trampoline for trap entry/exit to
@@ -84,12 +124,270 @@ kvminithart()
 {
   // 把内核页表的基地址写入satp寄存器，这个寄存器保存页表基址
   // 写入的是内核的页表，
-  w_satp(MAKE_SATP(kernel_pagetable));
+  uint64 asid;
+  int bits;
+
+  // the ASID bits that the hardware does not have read as zero.
+  w_satp(MAKE_SATP(kernel_pagetable, SATP_ASIDMASK));
+  asid = (r_satp() >> SATP_ASIDSHIFT) & SATP_ASIDMASK;
+  for(bits = 0; asid & (1L << bits); bits++)
+    ;
+  // a process needs a pair, besides the kernel's.
+  asidbits = bits >= 2 ? bits : 0;
+
+  w_satp(MAKE_SATP(kernel_pagetable, 0));
   // 刷新TLB缓存，到这之前TLB表应该还未使用
   // TLB是页表的缓存
   sfence_vma();
 }
 
+// Return the ASID number for group leader g's page tables,
+// just before this CPU runs on them, giving g a new number if
+// its old one is from an earlier generation.
+// The TLB may still hold stale entries for ASIDs that this
+// CPU ran before the page tables moved to another CPU and were
+// changed there, so they are flushed when they come back.
+// Called with interrupts off.
+uint64
+uvmasid(struct proc *g)
+{
+  struct cpu *c = mycpu();
+  int id = cpuid();
+  uint64 asid;
+
+  if(asidbits == 0)
+    return 0;
+  // nothing to do if g last ran here, in this generation.
+  asid = g->asid;
+  if(ASIDGEN(asid) == asidgen && c->asidgen == asidgen && g->asidcpu == id)
+    return ASIDNUM(asid);
+
+  acquire(&asid_lock);
+  if(ASIDGEN(g->asid) != asidgen){
+    if(KASID(nextasid) >= (1L << asidbits)){
+      asidgen++;
+      nextasid = 1;
+    }
+    g->asid = (asidgen << 16) | nextasid++;
+    // no TLB holds entries for it, once this CPU has
+    // caught up with the generation below.
+    g->asidcpu = id;
+  }
+  if(c->asidgen != asidgen){
+    c->asidgen = asidgen;
+    sfence_vma();
+  } else if(g->asidcpu != id){
+    sfence_vma_asid(UASID(ASIDNUM(g->asid)));
+    sfence_vma_asid(KASID(ASIDNUM(g->asid)));
+  }
+  g->asidcpu = id;
+  asid = ASIDNUM(g->asid);
+  release(&asid_lock);
+  return asid;
+}
+
+// Flush this CPU's TLB entries for user address va, after its
+// PTE in pagetable has changed, under both of the process's
+// ASIDs, since the kernel uses user addresses too. Only the
+// current process's page table can have live ASIDs: one being
+// built has none yet, and one being freed has lost them for good.
+void
+uvmflush(pagetable_t pagetable, uint64 va)
+{
+  struct proc *g = myproc() ? myproc()->group : 0;
+
+  if(g == 0 || g->pagetable != pagetable)
+    return;
+  va = PGROUNDDOWN(va);
+  if(asidbits == 0){
+    sfence_vma_va(va);
+    return;
+  }
+  sfence_vma_page(va, UASID(ASIDNUM(g->asid)));
+  sfence_vma_page(va, KASID(ASIDNUM(g->asid)));
+}
+
+// Threads of a group may run on several CPUs at once, each with
+// the group's page tables in its TLB, and uvmflush() only reaches
+// this CPU's. So before a page whose PTE has been removed or made
+// less permissive can be freed or shared, the other CPUs must be
+// made to drop their entries: uvmshootdown() asks each CPU that
+// is running on the group's page tables (c->vmgroup) to flush,
+// and waits until it has. A CPU notices the request in tlbsync(),
+// which it calls on every timer interrupt, while spinning for a
+// lock, and in the scheduler loop, so the wait ends within a tick
+// and cannot deadlock with a CPU waiting for a lock the caller
+// holds. CPUs that ran the group before but are not running it
+// now flush when they next do, since the group's asidcpu no longer
+// names them (see uvmasid()).
+
+// Would a change to the PTEs of pagetable have to reach other
+// CPUs? Only if it belongs to the current group, and the group
+// has other threads.
+static int
+uvmremote(pagetable_t pagetable)
+{
+  struct proc *g = myproc() ? myproc()->group : 0;
+
+  return g && g->pagetable == pagetable && g->nthread > 0;
+}
+
+// Flush this CPU's TLB if another CPU has asked it to.
+void
+tlbsync(void)
+{
+  struct cpu *c;
+  uint req;
+
+  push_off();
+  c = mycpu();
+  req = *(volatile uint*)&c->tlbreq;
+  if(req != c->tlbdone){
+    sfence_vma();
+    __sync_synchronize();
+    *(volatile uint*)&c->tlbdone = req;
+  }
+  pop_off();
+}
+
+// Make every other CPU drop its TLB entries for group leader g's
+// page tables, after the caller has changed some of their PTEs.
+void
+uvmshootdown(struct proc *g)
+{
+  struct cpu *c;
+  uint want[NCPU];
+  int i, id, n;
+
+  push_off();
+  id = cpuid();
+  if(asidbits && g->asidcpu != id){
+    acquire(&asid_lock);
+    g->asidcpu = id;
+    release(&asid_lock);
+  }
+  // pairs with the barrier in kvmuse(): either a CPU switching
+  // to g sees the new asidcpu, or it is seen here.
+  __sync_synchronize();
+  n = 0;
+  for(i = 0; i < NCPU; i++){
+    c = &cpus[i];
+    if(i != id && *(volatile struct proc**)&c->vmgroup == g){
+      want[i] = __sync_add_and_fetch(&c->tlbreq, 1);
+      n |= 1 << i;
+    }
+  }
+  while(n){
+    // another CPU may be waiting for this one meanwhile.
+    tlbsync();
+    for(i = 0; i < NCPU; i++){
+      if((n & (1 << i)) && (int)(*(volatile uint*)&cpus[i].tlbdone - want[i]) >= 0)
+        n &= ~(1 << i);
+    }
+  }
+  pop_off();
+}
+
+// Map the kernel's device registers into user page table
+// pagetable, for the kernel page table that will share its
+// first 1GB; the registers keep their kernel PTEs, without
+// PTE_U. Also makes the level-1 page-table pages of the two
+// shared regions, so that they last as long as pagetable does.
+// Returns 0 on success, -1 if out of memory.
+int
+uvmkmap(pagetable_t pagetable)
+{
+  pagetable_t kdev = (pagetable_t)PTE2PA(kernel_pagetable[0]);
+  pagetable_t l1;
+
+  if(walksuper(pagetable, 0, 1) == 0 || walksuper(pagetable, MMAPBASE, 1) == 0)
+    return -1;
+  l1 = (pagetable_t)PTE2PA(pagetable[0]);
+  for(int i = 0; i < 512; i++)
+    if(kdev[i] & PTE_V)
+      l1[i] = kdev[i];
+  return 0;
+}
+
+// Take the device registers out of pagetable before it is
+// freed; their page-table pages belong to the kernel.
+void
+uvmkunmap(pagetable_t pagetable)
+{
+  pagetable_t kdev = (pagetable_t)PTE2PA(kernel_pagetable[0]);
+  pagetable_t l1;
+
+  if((pagetable[0] & PTE_V) == 0)
+    return;
+  l1 = (pagetable_t)PTE2PA(pagetable[0]);
+  for(int i = 0; i < 512; i++)
+    if(kdev[i] & PTE_V)
+      l1[i] = 0;
+}
+
+// Point kernel page table kpagetable at the shared regions of
+// user page table pagetable.
+static void
+kvmshare(pagetable_t kpagetable, pagetable_t pagetable)
+{
+  kpagetable[PX(2, 0)] = pagetable[PX(2, 0)];
+  kpagetable[PX(2, MMAPBASE)] = pagetable[PX(2, MMAPBASE)];
+}
+
+// Create the kernel page table for a process whose user page
+// table is pagetable (made by proc_pagetable()). It is a single
+// page: everything below the top level is shared, with the
+// kernel page table or with pagetable.
+// Returns 0 if out of memory.
+pagetable_t
+kvmcreate(pagetable_t pagetable)
+{
+  pagetable_t kpagetable;
+
+  if((kpagetable = (pagetable_t)kalloc()) == 0)
+    return 0;
+  memmove(kpagetable, kernel_pagetable, PGSIZE);
+  kvmshare(kpagetable, pagetable);
+  return kpagetable;
+}
+
+// Switch this CPU to p's kernel page table, or to the kernel's
+// own if p is 0 or has none.
+void
+kvmuse(struct proc *p)
+{
+  struct cpu *c;
+
+  push_off();
+  c = mycpu();
+  if(p && p->kpagetable){
+    c->vmgroup = p->group;
+    // see uvmshootdown().
+    __sync_synchronize();
+    w_satp(MAKE_SATP(p->kpagetable, KASID(uvmasid(p->group))));
+  } else {
+    w_satp(MAKE_SATP(kernel_pagetable, 0));
+    c->vmgroup = 0;
+  }
+  // without ASIDs, nothing tells the page tables' TLB entries apart.
+  if(asidbits == 0)
+    sfence_vma();
+  pop_off();
+}
+
+// exec() has given p a new user page table: share it in p's
+// kernel page table and switch to that under new ASIDs, since
+// the TLB entries under the old ones are for the old memory.
+void
+kvmexec(struct proc *p)
+{
+  kvmshare(p->kpagetable, p->pagetable);
+  acquire(&asid_lock);
+  p->asid = 0;
+  release(&asid_lock);
+  kvmuse(p);
+}
+
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page-table pages.
@@ -102,24 +400,93 @@ kvminithart()
 //   21..39 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..12 -- 12 bits of byte offset within the page.
+//
+// A valid level-1 PTE may itself be a leaf, mapping a 2MB
+// superpage; walk() splits such a superpage into 512 pages
+// first, so that the PTE it returns maps just va's page.
 static pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  pte_t *pte;
+
+  if((pte = walksuper(pagetable, va, alloc)) == 0)
+    return 0;
+  if((*pte & PTE_V) && PTE_LEAF(*pte) && demote(pte) != 0)
+    return 0;
+  if(*pte & PTE_V) {
+    pagetable = (pagetable_t)PTE2PA(*pte);
+  } else {
+    if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
+      return 0;
+    *pte = PA2PTE(pagetable) | PTE_V;
+  }
+  return &pagetable[PX(0, va)];
+}
+
+// Return the address of the level-1 PTE for va, which maps
+// the 2MB-aligned superpage around va or points to the
+// page-table page for it. If alloc!=0, create the level-1
+// page-table page if need be.
+static pte_t *
+walksuper(pagetable_t pagetable, uint64 va, int alloc)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
-    pte_t *pte = &pagetable[PX(level, va)];
-    if(*pte & PTE_V) {
-      pagetable = (pagetable_t)PTE2PA(*pte);
-    } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
-        return 0;
-      memset(pagetable, 0, PGSIZE);
-      *pte = PA2PTE(pagetable) | PTE_V;
-    }
+  pte_t *pte = &pagetable[PX(2, va)];
+  if(*pte & PTE_V) {
+    pagetable = (pagetable_t)PTE2PA(*pte);
+  } else {
+    if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
+      return 0;
+    *pte = PA2PTE(pagetable) | PTE_V;
   }
-  return &pagetable[PX(0, va)];
+  return &pagetable[PX(1, va)];
+}
+
+// Return the address of the leaf PTE that maps va, without
+// splitting a superpage, or 0 if there is none. *size is set
+// to the size of the page the PTE maps.
+static pte_t *
+walkleaf(pagetable_t pagetable, uint64 va, uint64 *size)
+{
+  pte_t *pte;
+
+  if((pte = walksuper(pagetable, va, 0)) == 0 || (*pte & PTE_V) == 0)
+    return 0;
+  if(PTE_LEAF(*pte)){
+    *size = SUPERPGSIZE;
+    return pte;
+  }
+  pte = &((pagetable_t)PTE2PA(*pte))[PX(0, va)];
+  if((*pte & PTE_V) == 0)
+    return 0;
+  *size = PGSIZE;
+  return pte;
+}
+
+// Split the superpage mapped by level-1 PTE *pte into 512
+// pages with the same permissions, so that they can be
+// unmapped or shared one at a time. A user superpage also
+// becomes 512 separately freed pages (see ksplit()).
+// Returns 0 on success, -1 if out of memory.
+static int
+demote(pte_t *pte)
+{
+  pagetable_t pagetable;
+  uint64 pa = PTE2PA(*pte);
+  uint flags = PTE_FLAGS(*pte);
+
+  if((pagetable = (pagetable_t)kalloc()) == 0)
+    return -1;
+  for(int i = 0; i < 512; i++)
+    pagetable[i] = PA2PTE(pa + i*PGSIZE) | flags;
+  if(flags & PTE_U)
+    ksplit((void*)pa);
+  // the translations are the same as before, so there is no
+  // stale TLB entry to flush.
+  *pte = PA2PTE(pagetable) | PTE_V;
+  return 0;
 }
 
 // Look up a virtual address, return the physical address,
@@ -129,19 +496,17 @@ uint64
 walkaddr(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
-  uint64 pa;
+  uint64 pa, size;
 
   if(va >= MAXVA)
     return 0;
 
-  pte = walk(pagetable, va, 0);
+  pte = walkleaf(pagetable, va, &size);
   if(pte == 0)
     return 0;
-  if((*pte & PTE_V) == 0)
-    return 0;
   if((*pte & PTE_U) == 0)
     return 0;
-  pa = PTE2PA(*pte);
+  pa = PTE2PA(*pte) + (PGROUNDDOWN(va) & (size - 1));
   return pa;
 }
 
@@ -155,6 +520,19 @@ kvmmap(uint64 va, uint64 pa, uint64 sz, int perm)
     panic("kvmmap");
 }
 
+// remove a page from the kernel page table and free it.
+// does not flush TLB: see kvmgen in proc.c.
+void
+kvmunmap(uint64 va)
+{
+  pte_t *pte;
+
+  if((pte = walk(kernel_pagetable, va, 0)) == 0 || (*pte & PTE_V) == 0)
+    panic("kvmunmap");
+  kfree((void*)PTE2PA(*pte));
+  *pte = 0;
+}
+
 // translate a kernel virtual address to
 // a physical address. only needed for
 // addresses on the stack.
@@ -162,22 +540,22 @@ kvmmap(uint64 va, uint64 pa, uint64 sz, int perm)
 uint64
 kvmpa(uint64 va)
 {
-  uint64 off = va % PGSIZE;
+  uint64 size;
   pte_t *pte;
   uint64 pa;
   
-  pte = walk(kernel_pagetable, va, 0);
+  pte = walkleaf(kernel_pagetable, va, &size);
   if(pte == 0)
     panic("kvmpa");
-  if((*pte & PTE_V) == 0)
-    panic("kvmpa");
   pa = PTE2PA(*pte);
-  return pa+off;
+  return pa + (va & (size - 1));
 }
 
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
-// be page-aligned. Returns 0 on success, -1 if walk() couldn't
+// be page-aligned. Wherever both addresses are 2MB-aligned and
+// a whole 2MB remains, a superpage is mapped instead of 512
+// pages. Returns 0 on success, -1 if walk() couldn't
 // allocate a needed page-table page.
 int
 mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
@@ -188,6 +566,19 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   a = PGROUNDDOWN(va);
   last = PGROUNDDOWN(va + size - 1);
   for(;;){
+    if(a % SUPERPGSIZE == 0 && pa % SUPERPGSIZE == 0 &&
+       last - a >= SUPERPGSIZE - PGSIZE){
+      if((pte = walksuper(pagetable, a, 1)) == 0)
+        return -1;
+      if(*pte & PTE_V)
+        panic("remap");
+      *pte = PA2PTE(pa) | perm | PTE_V;
+      if(last - a == SUPERPGSIZE - PGSIZE)
+        break;
+      a += SUPERPGSIZE;
+      pa += SUPERPGSIZE;
+      continue;
+    }
     if((pte = walk(pagetable, a, 1)) == 0)
       return -1;
     if(*pte & PTE_V)
@@ -201,36 +592,93 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   return 0;
 }
 
-// Remove mappings from a page table. The mappings in
-// the given range must exist. Optionally free the
-// physical memory.
+// Remove mappings from a page table. Pages in the range
+// that were never faulted in (see vmfault()) are skipped.
+// A superpage only partly in the range is split first.
+// Optionally free the physical memory.
+// If other CPUs may be running on pagetable, the pages are only
+// freed once they have flushed their TLBs: until then the PTEs
+// keep the pages' addresses, with PTE_V clear, for uvmreap().
+// The caller holds the group's glock then, so no one else looks
+// at them meanwhile.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 size, int do_free)
 {
-  uint64 a, last;
+  uint64 a, last, sz;
   pte_t *pte;
   uint64 pa;
+  int remote = uvmremote(pagetable);
+  int defer = do_free && remote;
 
   a = PGROUNDDOWN(va);
   last = PGROUNDDOWN(va + size - 1);
   for(;;){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
-    if((*pte & PTE_V) == 0){
-      printf("va=%p pte=%p\n", a, *pte);
-      panic("uvmunmap: not mapped");
+    if((pte = walkleaf(pagetable, a, &sz)) != 0 && sz == SUPERPGSIZE){
+      if(a % SUPERPGSIZE == 0 && last - a >= SUPERPGSIZE - PGSIZE){
+        if(do_free && !defer)
+          ksuperfree((void*)PTE2PA(*pte));
+        *pte = defer ? *pte & ~PTE_V : 0;
+        uvmflush(pagetable, a);
+        if(last - a == SUPERPGSIZE - PGSIZE)
+          break;
+        a += SUPERPGSIZE;
+        continue;
+      }
+      if(demote(pte) != 0)
+        panic("uvmunmap: demote");
     }
-    if(PTE_FLAGS(*pte) == PTE_V)
-      panic("uvmunmap: not a leaf");
-    if(do_free){
-      pa = PTE2PA(*pte);
-      kfree((void*)pa);
+    if((pte = walk(pagetable, a, 0)) != 0 && (*pte & PTE_GUARD) != 0)
+      *pte = 0;
+    if(pte != 0 && (*pte & PTE_V) != 0){
+      if(PTE_FLAGS(*pte) == PTE_V)
+        panic("uvmunmap: not a leaf");
+      if(do_free && !defer){
+        pa = PTE2PA(*pte);
+        kfree((void*)pa);
+      }
+      *pte = defer ? *pte & ~PTE_V : 0;
+      uvmflush(pagetable, a);
+    }
+    if(a == last)
+      break;
+    a += PGSIZE;
+  }
+  if(remote)
+    uvmshootdown(myproc()->group);
+  if(defer)
+    uvmreap(pagetable, va, size);
+}
+
+// Free the pages that uvmunmap() left in the invalid PTEs of
+// [va, va+size), and clear the PTEs.
+static void
+uvmreap(pagetable_t pagetable, uint64 va, uint64 size)
+{
+  uint64 a, last;
+  pte_t *pte;
+
+  a = PGROUNDDOWN(va);
+  last = PGROUNDDOWN(va + size - 1);
+  for(;;){
+    if((pte = walksuper(pagetable, a, 0)) != 0 && *pte != 0){
+      if((*pte & PTE_V) == 0){
+        // a whole superpage; uvmunmap() split any partial one.
+        ksuperfree((void*)PTE2PA(*pte));
+        *pte = 0;
+        if(last - a == SUPERPGSIZE - PGSIZE)
+          break;
+        a += SUPERPGSIZE;
+        continue;
+      }
+      pte = &((pagetable_t)PTE2PA(*pte))[PX(0, a)];
+      if(*pte != 0 && (*pte & (PTE_V|PTE_GUARD)) == 0){
+        kfree((void*)PTE2PA(*pte));
+        *pte = 0;
+      }
     }
-    *pte = 0;
     if(a == last)
       break;
     a += PGSIZE;
-    pa += PGSIZE;
   }
 }
 
@@ -238,12 +686,7 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 size, int do_free)
 pagetable_t
 uvmcreate()
 {
-  pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
-  if(pagetable == 0)
-    panic("uvmcreate: out of memory");
-  memset(pagetable, 0, PGSIZE);
-  return pagetable;
+  return (pagetable_t) kalloc_zeroed();
 }
 
 // Load the user initcode into address 0 of pagetable,
@@ -256,14 +699,14 @@ uvminit(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("inituvm: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
 
 // Allocate PTEs and physical memory to grow process from oldsz to
 // newsz, which need not be page aligned.  Returns new size or 0 on error.
+// Whole, aligned 2MB stretches get a superpage if there is one free.
 uint64
 uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 {
@@ -276,12 +719,22 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
   oldsz = PGROUNDUP(oldsz);
   a = oldsz;
   for(; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    if(a % SUPERPGSIZE == 0 && newsz - a >= SUPERPGSIZE &&
+       (mem = ksuperalloc()) != 0){
+      memset(mem, 0, SUPERPGSIZE);
+      if(mappages(pagetable, a, SUPERPGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
+        ksuperfree(mem);
+        uvmdealloc(pagetable, a, oldsz);
+        return 0;
+      }
+      a += SUPERPGSIZE - PGSIZE;
+      continue;
+    }
+    mem = kalloc_zeroed();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -333,47 +786,205 @@ freewalk(pagetable_t pagetable)
 void
 uvmfree(pagetable_t pagetable, uint64 sz)
 {
-  uvmunmap(pagetable, 0, sz, 1);
+  if(sz > 0)
+    uvmunmap(pagetable, 0, sz, 1);
   freewalk(pagetable);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Given a parent process's page table, share
+// its memory with a child's page table.
+// Copies only the page table: writable pages are
+// made read-only and PTE_COW in both, and each
+// side gets its own copy on the first store
+// (see uvmcow()).
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+{
+  return uvmshare(old, new, 0, sz, 1);
+}
+
+// Map the pages present in old at [va, va+len) into new at
+// the same addresses. If cow is set, writable pages become
+// copy-on-write in both; otherwise both keep writing the
+// same physical pages (MAP_SHARED mappings).
+// returns 0 on success, -1 on failure.
+int
+uvmshare(pagetable_t old, pagetable_t new, uint64 va, uint64 len, int cow)
 {
   pte_t *pte;
-  uint64 pa, i;
+  uint64 pa, i, size;
   uint flags;
-  char *mem;
+  int downgraded = 0;
 
-  for(i = 0; i < sz; i += PGSIZE){
+  for(i = va; i < va + len; i += PGSIZE){
+    // pages of a lazily grown heap or a mapped file that
+    // were never touched have nothing to share. a guard page
+    // stays one in the copy.
+    if(walkleaf(old, i, &size) == 0){
+      if((pte = walk(old, i, 0)) != 0 && (*pte & PTE_GUARD)){
+        if((pte = walk(new, i, 1)) == 0)
+          goto err;
+        *pte = PTE_GUARD;
+      }
+      continue;
+    }
+    // a superpage is shared as 512 pages.
     if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+      goto err;
+    if(cow && (*pte & PTE_W)){
+      *pte = (*pte & ~PTE_W) | PTE_COW;
+      uvmflush(old, i);
+      downgraded = 1;
+    }
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    }
+    kref((void*)pa);
   }
+  // other threads must not go on storing to the shared pages
+  // through writable TLB entries.
+  if(downgraded && uvmremote(old))
+    uvmshootdown(myproc()->group);
   return 0;
 
  err:
-  uvmunmap(new, 0, i, 1);
+  if(downgraded && uvmremote(old))
+    uvmshootdown(myproc()->group);
+  if(i > va)
+    uvmunmap(new, va, i - va, 1);
   return -1;
 }
 
-// mark a PTE invalid for user access.
+// Resolve a store to copy-on-write page va: give pagetable its
+// own writable copy, or just make the page writable again if
+// no one else shares it any more.
+// Returns 0 on success, -1 if va is not a copy-on-write page
+// or there is no memory for the copy.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  va = PGROUNDDOWN(va);
+  if((pte = walk(pagetable, va, 0)) == 0)
+    return -1;
+  if((*pte & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U|PTE_COW))
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+  if(krefcount((void*)pa) == 1){
+    *pte = PA2PTE(pa) | flags;
+    uvmflush(pagetable, va);
+    return 0;
+  }
+  if((mem = kalloc()) == 0)
+    return -1;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  uvmflush(pagetable, va);
+  // other threads may still read the old page through their TLBs.
+  if(uvmremote(pagetable))
+    uvmshootdown(myproc()->group);
+  kfree((void*)pa);
+  return 0;
+}
+
+// Handle a fault on user address va in the current process's
+// page table: break copy-on-write sharing on a store, allocate
+// a zeroed page for heap that sbrk() reserved but nothing has
+// touched yet, or read in a page of a mapped file or of the
+// program itself. Called from usertrap() and from the
+// copyin/copyout helpers. access is PTE_R, PTE_W or PTE_X, for
+// a load, a store or an instruction fetch.
+// Threads share the page table and may fault on the same page
+// at once, so the work is done under the group's glock.
+// Returns the physical address now mapped at va's page,
+// or 0 if va is not a legal address to fault in.
+uint64
+vmfault(pagetable_t pagetable, uint64 va, int access)
+{
+  struct proc *g = myproc() ? myproc()->group : 0;
+  pte_t *pte;
+  char *mem;
+  uint64 pa = 0, size, sva;
+
+  if(va >= MAXVA)
+    return 0;
+  va = PGROUNDDOWN(va);
+  if(g)
+    acquire(&g->glock);
+  pte = walkleaf(pagetable, va, &size);
+  if(pte){
+    // a page the user may not touch, or one with a reserved
+    // encoding (PTE_W without PTE_R), would only fault again.
+    if((*pte & (PTE_U|PTE_R)) != (PTE_U|PTE_R))
+      goto out;
+    if(access == PTE_X && (*pte & PTE_X) == 0)
+      goto out;
+    if(access != PTE_W || (*pte & PTE_W) || ((*pte & PTE_COW) && uvmcow(pagetable, va) == 0))
+      pa = walkaddr(pagetable, va);
+    goto out;
+  }
+
+  // not mapped: only the untouched part of the heap below
+  // p->sz, or of a mapped file, may be faulted in. the
+  // program's own segments are read from its file; the rest
+  // below p->sz, bss included, starts out zeroed.
+  if(g == 0 || pagetable != g->pagetable)
+    goto out;
+  // the stack guard page (see uvmclear()).
+  if((pte = walk(pagetable, va, 0)) != 0 && (*pte & PTE_GUARD))
+    goto out;
+  // fileread() or filewrite() holds an inode lock, and must not
+  // wait for another's.
+  if(myproc()->nofilefault && (va >= g->sz || segoverlap(g, va, PGSIZE)))
+    goto out;
+  if(va >= g->sz){
+    release(&g->glock);
+    return vmafault(g, va);
+  }
+  if(segoverlap(g, va, PGSIZE)){
+    release(&g->glock);
+    return segfault(g, va);
+  }
+  // if the whole 2MB around va is heap that nothing has
+  // touched, map a superpage there.
+  sva = SUPERPGROUNDDOWN(va);
+  if(sva + SUPERPGSIZE <= g->sz && !segoverlap(g, sva, SUPERPGSIZE) &&
+     ((pte = walksuper(pagetable, sva, 0)) == 0 || (*pte & PTE_V) == 0) &&
+     (mem = ksuperalloc()) != 0){
+    memset(mem, 0, SUPERPGSIZE);
+    if(mappages(pagetable, sva, SUPERPGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
+      ksuperfree(mem);
+      goto out;
+    }
+    pa = (uint64)mem + (va - sva);
+    goto out;
+  }
+  if((mem = kalloc_zeroed()) == 0)
+    goto out;
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
+    kfree(mem);
+    goto out;
+  }
+  pa = (uint64)mem;
+out:
+  if(g)
+    release(&g->glock);
+  return pa;
+}
+
+// make the page at va invalid, and free it: a guard page that
+// neither the user nor the kernel's copies through SUM may touch,
+// and that vmfault() never faults in again.
 // used by exec for the user stack guard page.
 void
 uvmclear(pagetable_t pagetable, uint64 va)
@@ -381,9 +992,58 @@ uvmclear(pagetable_t pagetable, uint64 va)
   pte_t *pte;
   
   pte = walk(pagetable, va, 0);
-  if(pte == 0)
+  if(pte == 0 || (*pte & PTE_V) == 0)
     panic("uvmclear");
-  *pte &= ~PTE_U;
+  kfree((void*)PTE2PA(*pte));
+  *pte = PTE_GUARD;
+  uvmflush(pagetable, va);
+}
+
+// Are all of the current process's pages in [va, va+len)
+// mapped? Then a copy to or from them cannot have to read a
+// page in from a file, unless another thread unmaps them first.
+int
+uvmresident(uint64 va, uint64 len)
+{
+  struct proc *g = myproc()->group;
+  uint64 a, size;
+  int ok = 1;
+
+  if(va + len < va || va + len > MAXVA)
+    return 0;
+  acquire(&g->glock);
+  for(a = PGROUNDDOWN(va); a < va + len; a += PGSIZE){
+    if(walkleaf(g->pagetable, a, &size) == 0){
+      ok = 0;
+      break;
+    }
+  }
+  release(&g->glock);
+  return ok;
+}
+
+// Is pagetable the one the kernel is running on, through the
+// current process's kernel page table?
+static int
+uvmcurrent(pagetable_t pagetable)
+{
+  struct proc *p = myproc();
+
+  return p && p->kpagetable && p->group->pagetable == pagetable;
+}
+
+// Bytes from user address va to the end of the region of user
+// memory it is in (the heap or the mmap() area), or 0 if it is
+// in neither. The kernel must not copy through other addresses:
+// in the kernel page table they are the kernel's own.
+static uint64
+uvmlimit(uint64 va)
+{
+  if(va < MAXHEAP)
+    return MAXHEAP - va;
+  if(va >= MMAPBASE && va < MMAPTOP)
+    return MMAPTOP - va;
+  return 0;
 }
 
 // Copy from kernel to user.
@@ -392,11 +1052,63 @@ uvmclear(pagetable_t pagetable, uint64 va)
 int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
-  uint64 n, va0, pa0;
+  if(!uvmcurrent(pagetable))
+    return copyoutwalk(pagetable, dstva, src, len);
+  if(len > uvmlimit(dstva))
+    return len == 0 ? 0 : -1;
+  return copyuser((void*)dstva, src, len);
+}
+
+// Copy from user to kernel.
+// Copy len bytes to dst from virtual address srcva in a given page table.
+// Return 0 on success, -1 on error.
+int
+copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
+{
+  if(!uvmcurrent(pagetable))
+    return copyinwalk(pagetable, dst, srcva, len);
+  if(len > uvmlimit(srcva))
+    return len == 0 ? 0 : -1;
+  return copyuser(dst, (void*)srcva, len);
+}
+
+// Copy a null-terminated string from user to kernel.
+// Copy bytes to dst from virtual address srcva in a given page table,
+// until a '\0', or max.
+// Return 0 on success, -1 on error.
+int
+copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
+{
+  uint64 n;
+
+  if(!uvmcurrent(pagetable))
+    return copyinstrwalk(pagetable, dst, srcva, max);
+  if((n = uvmlimit(srcva)) == 0)
+    return -1;
+  if(max > n)
+    max = n;
+  return copyuserstr(dst, (char*)srcva, max);
+}
+
+// copyout() into a page table the kernel is not running on,
+// such as the one exec() is building, through the direct map.
+static int
+copyoutwalk(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
+{
+  uint64 n, va0, pa0, size;
+  pte_t *pte;
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
+    if(va0 >= MAXVA)
+      return -1;
+    // the kernel writes through the direct map, so it must
+    // break copy-on-write sharing and fault in lazy pages itself.
+    pte = walkleaf(pagetable, va0, &size);
+    if(pte == 0 || (*pte & PTE_COW))
+      pa0 = vmfault(pagetable, va0, PTE_W);
+    else
+      pa0 = walkaddr(pagetable, va0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (dstva - va0);
@@ -411,17 +1123,16 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
   return 0;
 }
 
-// Copy from user to kernel.
-// Copy len bytes to dst from virtual address srcva in a given page table.
-// Return 0 on success, -1 on error.
-int
-copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
+// copyin() from a page table the kernel is not running on.
+static int
+copyinwalk(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
   uint64 n, va0, pa0;
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    if((pa0 = walkaddr(pagetable, va0)) == 0)
+      pa0 = vmfault(pagetable, va0, PTE_R);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -436,19 +1147,17 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
   return 0;
 }
 
-// Copy a null-terminated string from user to kernel.
-// Copy bytes to dst from virtual address srcva in a given page table,
-// until a '\0', or max.
-// Return 0 on success, -1 on error.
-int
-copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
+// copyinstr() from a page table the kernel is not running on.
+static int
+copyinstrwalk(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
   uint64 n, va0, pa0;
   int got_null = 0;
 
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    if((pa0 = walkaddr(pagetable, va0)) == 0)
+      pa0 = vmfault(pagetable, va0, PTE_R);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
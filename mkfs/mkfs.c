@@ -22,7 +22,7 @@
 
 int nbitmap = FSSIZE/(BSIZE*8) + 1;
 int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+int nlog = 2 * (LOGSIZE+1);  // two log regions, each a header and LOGSIZE blocks
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
@@ -31,6 +31,7 @@ struct superblock sb;
 char zeroes[BSIZE];
 uint freeinode = 1;
 uint freeblock;
+int extents;  // build a FS_EXTENT file system (-e)
 
 
 void balloc(int);
@@ -76,8 +77,14 @@ main(int argc, char *argv[])
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
+  if(argc > 1 && strcmp(argv[1], "-e") == 0){
+    extents = 1;
+    argc--;
+    argv++;
+  }
+
   if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+    fprintf(stderr, "Usage: mkfs [-e] fs.img files...\n");
     exit(1);
   }
 
@@ -102,6 +109,7 @@ main(int argc, char *argv[])
   sb.logstart = xint(2);
   sb.inodestart = xint(2+nlog);
   sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.features = xint(extents ? FS_EXTENT : 0);
 
   printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
          nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
@@ -260,6 +268,60 @@ balloc(int used)
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// return entry i of indirect block ind, allocating it if necessary.
+uint
+indirect(uint ind, uint i)
+{
+  uint a[NINDIRECT];
+
+  rsect(ind, (char*)a);
+  if(a[i] == 0){
+    a[i] = xint(freeblock++);
+    wsect(ind, (char*)a);
+  }
+  return xint(a[i]);
+}
+
+// return the disk block holding file block fbn of an extent-mapped
+// inode, allocating it if fbn is just past the file's last block.
+uint
+extent(struct dinode *din, uint fbn)
+{
+  struct extent x[NEXTENT + NXEXTENT];
+  uint i, b;
+
+  memset(x, 0, sizeof(x));
+  memmove(x, din->addrs, NEXTENT * sizeof(struct extent));
+  if(xint(din->addrs[NDIRECT+1]))
+    rsect(xint(din->addrs[NDIRECT+1]), x + NEXTENT);
+  for(i = 0; i < NEXTENT + NXEXTENT && xint(x[i].len); i++){
+    if(fbn < xint(x[i].len))
+      return xint(x[i].start) + fbn;
+    fbn -= xint(x[i].len);
+  }
+  assert(fbn == 0);
+
+  // files are written one after another, so the next free
+  // block usually extends the last extent.
+  b = freeblock;
+  if(i > 0 && xint(x[i-1].start) + xint(x[i-1].len) == b){
+    x[i-1].len = xint(xint(x[i-1].len) + 1);
+  } else {
+    assert(i < NEXTENT + NXEXTENT);
+    if(i >= NEXTENT && xint(din->addrs[NDIRECT+1]) == 0){
+      din->addrs[NDIRECT+1] = xint(freeblock++);
+      b = freeblock;
+    }
+    x[i].start = xint(b);
+    x[i].len = xint(1);
+  }
+  freeblock++;
+  memmove(din->addrs, x, NEXTENT * sizeof(struct extent));
+  if(xint(din->addrs[NDIRECT+1]))
+    wsect(xint(din->addrs[NDIRECT+1]), x + NEXTENT);
+  return b;
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -267,7 +329,6 @@ iappend(uint inum, void *xp, int n)
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
 
   rinode(inum, &din);
@@ -276,21 +337,25 @@ iappend(uint inum, void *xp, int n)
   while(n > 0){
     fbn = off / BSIZE;
     assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
+    if(extents){
+      x = extent(&din, fbn);
+    } else if(fbn < NDIRECT){
       if(xint(din.addrs[fbn]) == 0){
         din.addrs[fbn] = xint(freeblock++);
       }
       x = xint(din.addrs[fbn]);
-    } else {
+    } else if(fbn < NDIRECT + NINDIRECT){
       if(xint(din.addrs[NDIRECT]) == 0){
         din.addrs[NDIRECT] = xint(freeblock++);
       }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
+      x = indirect(xint(din.addrs[NDIRECT]), fbn - NDIRECT);
+    } else {
+      if(xint(din.addrs[NDIRECT+1]) == 0){
+        din.addrs[NDIRECT+1] = xint(freeblock++);
       }
-      x = xint(indirect[fbn-NDIRECT]);
+      x = fbn - NDIRECT - NINDIRECT;
+      x = indirect(indirect(xint(din.addrs[NDIRECT+1]), x / NINDIRECT),
+                   x % NINDIRECT);
     }
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
@@ -102,10 +102,66 @@ void test1()
   }
 }
 
+// Several processes at once make and close pipes as fast as
+// they can, so that the kernel allocates and frees file and
+// pipe structs (and, when the caches run dry, buddy blocks)
+// on all CPUs together. Prints how long it took.
+void test2()
+{
+  enum { NCHILD = 8, NPIPE = 6, ROUNDS = 2000 };
+  int fds[NPIPE][2];
+  int i, j, r, t0;
+  char c;
+
+  printf("allocbench: start\n");
+  t0 = uptime();
+  for(i = 0; i < NCHILD; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("fork failed");
+      exit(1);
+    }
+    if(pid == 0){
+      for(r = 0; r < ROUNDS; r++){
+        for(j = 0; j < NPIPE; j++){
+          if(pipe(fds[j]) != 0){
+            printf("pipe() failed\n");
+            exit(1);
+          }
+        }
+        for(j = 0; j < NPIPE; j++){
+          c = j;
+          if(write(fds[j][1], &c, 1) != 1 || read(fds[j][0], &c, 1) != 1 || c != j){
+            printf("pipe %d broken\n", j);
+            exit(1);
+          }
+          close(fds[j][0]);
+          close(fds[j][1]);
+        }
+      }
+      exit(0);
+    }
+  }
+
+  int all_ok = 1;
+  for(i = 0; i < NCHILD; i++){
+    int xstatus;
+    wait(&xstatus);
+    if(xstatus != 0)
+      all_ok = 0;
+  }
+  if(all_ok)
+    printf("allocbench: %d procs x %d pipes x %d rounds: %d ticks\n",
+           NCHILD, NPIPE, ROUNDS, uptime() - t0);
+  else
+    printf("allocbench: FAILED\n");
+}
+
 int
 main(int argc, char *argv[])
 {
   test0();
   test1();
+  test2();
   exit(0);
 }
@@ -115,6 +115,7 @@ test0()
   }
   printf("test0 results:\n");
   n = ntas(1);
+  printf("test0: %d kmem/bcache test-and-sets\n", n);
   if (n < 500)
     printf("test0: OK\n");
   else
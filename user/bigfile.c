@@ -4,11 +4,22 @@
 #include "kernel/fcntl.h"
 #include "kernel/fs.h"
 
+// report the rate at which blocks went through, in KB per second.
+// a tick is about 1/10th of a second.
+void
+throughput(char *what, int blocks, int ticks)
+{
+  if(ticks < 1)
+    ticks = 1;
+  printf("bigfile: %s %d KB in %d ticks, %d KB/s\n",
+         what, blocks * (BSIZE / 1024), ticks, blocks * (BSIZE / 1024) * 10 / ticks);
+}
+
 int
 main()
 {
   char buf[BSIZE];
-  int fd, i, blocks;
+  int fd, i, blocks, t0, t1;
 
   fd = open("big.file", O_CREATE | O_WRONLY);
   if(fd < 0){
@@ -17,6 +28,7 @@ main()
   }
 
   blocks = 0;
+  t0 = uptime();
   while(1){
     *(int*)buf = blocks;
     int cc = write(fd, buf, sizeof(buf));
@@ -27,6 +39,7 @@ main()
       printf(".");
   }
 
+  t1 = uptime();
   printf("\nwrote %d blocks\n", blocks);
   if(blocks != 65803) {
     printf("bigfile: file is too small\n");
@@ -34,11 +47,14 @@ main()
   }
   
   close(fd);
+  throughput("write", blocks, t1 - t0);
+
   fd = open("big.file", O_RDONLY);
   if(fd < 0){
     printf("bigfile: cannot re-open big.file for reading\n");
     exit(-1);
   }
+  t0 = uptime();
   for(i = 0; i < blocks; i++){
     int cc = read(fd, buf, sizeof(buf));
     if(cc <= 0){
@@ -52,6 +68,10 @@ main()
     }
   }
 
+  t1 = uptime();
+  close(fd);
+  throughput("read", blocks, t1 - t0);
+
   printf("bigfile done; ok\n"); 
 
   exit(0);
@@ -0,0 +1,108 @@
+// copybench [kb [rounds]]: how fast do read() and write() move
+// data between user memory and the kernel? Writes a kb-kilobyte
+// file and reads it back rounds times, then sends kb kilobytes
+// through a pipe rounds times. Most of the time goes to copyin()
+// and copyout().
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define CHUNK 8192
+
+char buf[CHUNK];
+
+// read or write the file kb kilobytes at a time, rounds times.
+int
+filebench(int kb, int rounds)
+{
+  int fd, r, n, t0;
+
+  t0 = uptime();
+  fd = open("copybench.tmp", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("copybench: cannot create file\n");
+    exit(1);
+  }
+  for(n = 0; n < kb*1024; n += CHUNK){
+    if(write(fd, buf, CHUNK) != CHUNK){
+      printf("copybench: write failed\n");
+      exit(1);
+    }
+  }
+  close(fd);
+  for(r = 0; r < rounds; r++){
+    if((fd = open("copybench.tmp", O_RDONLY)) < 0){
+      printf("copybench: cannot open file\n");
+      exit(1);
+    }
+    while((n = read(fd, buf, CHUNK)) > 0)
+      ;
+    close(fd);
+  }
+  unlink("copybench.tmp");
+  return uptime() - t0;
+}
+
+// send kb kilobytes through a pipe, rounds times.
+int
+pipebench(int kb, int rounds)
+{
+  int fds[2], pid, t0, total, n;
+
+  if(pipe(fds) < 0){
+    printf("copybench: pipe failed\n");
+    exit(1);
+  }
+  total = kb * 1024 * rounds;
+  t0 = uptime();
+  pid = fork();
+  if(pid < 0){
+    printf("copybench: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[0]);
+    for(n = 0; n < total; n += CHUNK){
+      if(write(fds[1], buf, CHUNK) != CHUNK){
+        printf("copybench: pipe write failed\n");
+        exit(1);
+      }
+    }
+    exit(0);
+  }
+  close(fds[1]);
+  n = 0;
+  while(n < total){
+    int cc = read(fds[0], buf, CHUNK);
+    if(cc <= 0){
+      printf("copybench: pipe read failed\n");
+      exit(1);
+    }
+    n += cc;
+  }
+  close(fds[0]);
+  wait(0);
+  return uptime() - t0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int kb, rounds, tf, tp;
+
+  kb = 64;
+  rounds = 20;
+  if(argc > 1)
+    kb = atoi(argv[1]);
+  if(argc > 2)
+    rounds = atoi(argv[2]);
+  memset(buf, 'x', sizeof(buf));
+
+  tf = filebench(kb, rounds);
+  tp = pipebench(kb, rounds);
+  printf("copybench: %d KB x %d rounds: file %d ticks, pipe %d ticks\n",
+         kb, rounds, tf, tp);
+  exit(0);
+}
@@ -0,0 +1,130 @@
+// exectest: check that processes exec()ing the same program
+// share its pages without seeing each other's stores, that
+// writing the program file is seen by the next exec(), that
+// a program can read its own file into pages not yet faulted
+// in from it, and that the file cannot be written while the
+// program runs; then time n execs of a program that exits at once.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+// initialized data, in the same segment as the text.
+char data[] = "exectest-data-v1";
+#define VERSION 15
+
+// initialized data too, so that it is faulted in from the file;
+// read() of the program file itself lands here.
+char hdr[4] = "hdr";
+
+// run "prog arg" and return its exit status.
+int
+run(char *prog, char *arg)
+{
+  char *argv[] = { prog, arg, 0 };
+  int pid, xstatus;
+
+  pid = fork();
+  if(pid < 0){
+    printf("exectest: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    exec(prog, argv);
+    printf("exectest: exec %s failed\n", prog);
+    exit(1);
+  }
+  wait(&xstatus);
+  return xstatus;
+}
+
+// copy file src to dst, changing the version digit of data
+// to v.
+int
+copyprog(char *src, char *dst, char v)
+{
+  struct stat st;
+  char *buf;
+  int fd, i, n;
+
+  if((fd = open(src, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+    return -1;
+  buf = sbrk(st.size);
+  n = read(fd, buf, st.size);
+  close(fd);
+  if(n != st.size)
+    return -1;
+  for(i = 0; i + VERSION < n; i++){
+    if(memcmp(buf + i, data, VERSION) == 0){
+      buf[i + VERSION] = v;
+      break;
+    }
+  }
+  if((fd = open(dst, O_CREATE|O_WRONLY)) < 0)
+    return -1;
+  n = write(fd, buf, st.size);
+  close(fd);
+  sbrk(-st.size);
+  return n == st.size ? 0 : -1;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, n, t0, fd;
+
+  if(argc > 1 && strcmp(argv[1], "store") == 0){
+    // an earlier run's store must not show.
+    if(data[VERSION] != '1')
+      exit(1);
+    data[VERSION] = 'x';
+    exit(0);
+  }
+  if(argc > 1 && argv[1][0] == 'v')
+    exit(data[VERSION] != argv[1][1]);
+  if(argc > 1 && strcmp(argv[1], "nop") == 0)
+    exit(0);
+
+  printf("exectest: start\n");
+  for(i = 0; i < 5; i++){
+    if(run("exectest", "store") != 0){
+      printf("exectest: saw another process's store: FAILED\n");
+      exit(1);
+    }
+  }
+
+  if(copyprog("exectest", "exectest.tmp", '1') < 0 ||
+     run("exectest.tmp", "v1") != 0 ||
+     copyprog("exectest", "exectest.tmp", '2') < 0 ||
+     run("exectest.tmp", "v2") != 0){
+    printf("exectest: exec ran stale contents: FAILED\n");
+    unlink("exectest.tmp");
+    exit(1);
+  }
+  unlink("exectest.tmp");
+
+  if((fd = open("exectest", O_RDONLY)) < 0 ||
+     read(fd, hdr, sizeof(hdr)) != sizeof(hdr) ||
+     hdr[0] != 0x7f || hdr[1] != 'E'){
+    printf("exectest: reading own file: FAILED\n");
+    exit(1);
+  }
+  close(fd);
+  // write back the byte just read, so that a failure does no harm.
+  if((fd = open("exectest", O_WRONLY)) < 0 || write(fd, hdr, 1) != -1){
+    printf("exectest: wrote own file while running: FAILED\n");
+    exit(1);
+  }
+  close(fd);
+  printf("exectest: OK\n");
+
+  n = 200;
+  if(argc > 1)
+    n = atoi(argv[1]);
+  t0 = uptime();
+  for(i = 0; i < n; i++)
+    run("exectest", "nop");
+  printf("exectest: %d execs: %d ticks\n", n, uptime() - t0);
+  exit(0);
+}
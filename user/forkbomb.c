@@ -0,0 +1,70 @@
+// forkbomb [total [step]]: fill the process table with up to total
+// idle processes, step at a time, and after each step time a fixed
+// number of fork/kill/wait rounds. With a pid hash and child lists
+// the time per round should not grow with the number of processes.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define ROUNDS 200
+
+int
+main(int argc, char *argv[])
+{
+  int total = 2000, step = 500;
+  int fds[2], n, i, pid, t0;
+  char c;
+
+  if(argc > 1)
+    total = atoi(argv[1]);
+  if(argc > 2)
+    step = atoi(argv[2]);
+
+  // the idle processes wait for the pipe to close.
+  if(pipe(fds) < 0){
+    printf("forkbomb: pipe failed\n");
+    exit(1);
+  }
+
+  for(n = 0; n <= total; ){
+    t0 = uptime();
+    for(i = 0; i < ROUNDS; i++){
+      pid = fork();
+      if(pid < 0){
+        printf("forkbomb: fork failed\n");
+        goto out;
+      }
+      if(pid == 0)
+        exit(0);
+      kill(pid);
+      if(wait(0) != pid){
+        printf("forkbomb: wait failed\n");
+        goto out;
+      }
+    }
+    printf("forkbomb: %d idle processes, %d fork/kill/wait in %d ticks\n",
+           n, ROUNDS, uptime() - t0);
+
+    for(i = 0; i < step && n < total; i++, n++){
+      pid = fork();
+      if(pid < 0){
+        printf("forkbomb: fork failed at %d processes\n", n);
+        goto out;
+      }
+      if(pid == 0){
+        close(fds[1]);
+        read(fds[0], &c, 1);
+        exit(0);
+      }
+    }
+    if(i == 0)
+      break;
+  }
+
+out:
+  close(fds[1]);
+  while(wait(0) > 0)
+    ;
+  exit(0);
+}
@@ -22,9 +22,10 @@ main(int argc, char *argv[])
 void test0()
 {
   void *a, *a1;
-  int n = 0;
+  int n = 0, t0;
   printf("start test0\n");  
   ntas(0);
+  t0 = uptime();
   for(int i = 0; i < NCHILD; i++){
     int pid = fork();
     if(pid < 0){
@@ -50,6 +51,8 @@ void test0()
   }
   printf("test0 results:\n");
   n = ntas(1);
+  printf("test0: %d kmem/bcache test-and-sets, %d ticks for %d alloc/free pairs\n",
+         n, uptime() - t0, NCHILD*N);
   if(n < 10) 
     printf("test0 OK\n");
   else
@@ -0,0 +1,86 @@
+// mlfqbench [hogs [rounds]]: measure how quickly an interactive
+// process gets the CPU while CPU-bound processes run.
+//
+// An echo process and the parent bounce a byte over pipes, with a
+// sleep(1) before each round as if waiting for a keystroke; meanwhile
+// hogs processes spin. Ideally each round takes just the one tick of
+// sleep; the extra ticks are the response delay.
+// With -n, the hogs lower their own priority with setpriority().
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/param.h"
+
+#define MAXHOGS 64
+#include "user/user.h"
+
+void
+hog(int nice)
+{
+  volatile uint64 x = 0;
+
+  if(nice && setpriority(getpid(), NPRIO-1) < 0){
+    printf("mlfqbench: setpriority failed\n");
+    exit(1);
+  }
+  for(;;)
+    x++;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int hogs = 4, rounds = 50, nice = 0;
+  int pids[MAXHOGS], p1[2], p2[2], i, n, echo, t0, t;
+  char c = 'x';
+
+  if(argc > 1 && strcmp(argv[1], "-n") == 0){
+    nice = 1;
+    argc--;
+    argv++;
+  }
+  if(argc > 1)
+    hogs = atoi(argv[1]);
+  if(argc > 2)
+    rounds = atoi(argv[2]);
+  if(hogs > MAXHOGS)
+    hogs = MAXHOGS;
+
+  if(pipe(p1) < 0 || pipe(p2) < 0){
+    printf("mlfqbench: pipe failed\n");
+    exit(1);
+  }
+  echo = fork();
+  if(echo == 0){
+    while(read(p1[0], &c, 1) == 1)
+      write(p2[1], &c, 1);
+    exit(0);
+  }
+
+  for(n = 0; n < hogs; n++){
+    if((pids[n] = fork()) < 0)
+      break;
+    if(pids[n] == 0)
+      hog(nice);
+  }
+
+  t0 = uptime();
+  for(i = 0; i < rounds; i++){
+    sleep(1);
+    if(write(p1[1], &c, 1) != 1 || read(p2[0], &c, 1) != 1){
+      printf("mlfqbench: echo failed\n");
+      break;
+    }
+  }
+  t = uptime() - t0;
+
+  for(i = 0; i < n; i++)
+    kill(pids[i]);
+  kill(echo);
+  for(i = 0; i < n + 1; i++)
+    wait(0);
+
+  printf("mlfqbench: %d hogs%s, %d rounds in %d ticks, %d extra ticks per 100 rounds\n",
+         n, nice ? " (niced)" : "", rounds, t, (t - rounds) * 100 / rounds);
+  exit(0);
+}
@@ -136,6 +136,17 @@ mmap_test(void)
   p = mmap(0, PGSIZE*3, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
   if (p != MAP_FAILED)
     err("mmap call should have failed");
+  if (mmap(0, PGSIZE, 0, MAP_PRIVATE, fd, 0) != MAP_FAILED)
+    err("mmap with no access should have failed");
+  if (close(fd) == -1)
+    err("close");
+
+  // a file opened write-only cannot be mapped at all: every
+  // mapping reads it in.
+  if ((fd = open(f, O_WRONLY)) == -1)
+    err("open");
+  if (mmap(0, PGSIZE, PROT_WRITE, MAP_PRIVATE, fd, 0) != MAP_FAILED)
+    err("mmap of write-only file should have failed");
   if (close(fd) == -1)
     err("close");
 
@@ -0,0 +1,74 @@
+// schedbench [pairs [rounds]]: each of pairs pairs of processes
+// bounces a byte back and forth over two pipes rounds times.
+// Every round trip is two sleeps and two wakeups, so this mostly
+// measures how fast the scheduler hands the CPU around.
+// Run it with different "make CPUS=" to see how it scales.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+void
+pingpong(int rounds)
+{
+  int p1[2], p2[2], i, pid;
+  char c = 'x';
+
+  if(pipe(p1) < 0 || pipe(p2) < 0){
+    printf("schedbench: pipe failed\n");
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("schedbench: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    for(i = 0; i < rounds; i++){
+      if(read(p1[0], &c, 1) != 1 || write(p2[1], &c, 1) != 1){
+        printf("schedbench: pong failed\n");
+        exit(1);
+      }
+    }
+    exit(0);
+  }
+  for(i = 0; i < rounds; i++){
+    if(write(p1[1], &c, 1) != 1 || read(p2[0], &c, 1) != 1){
+      printf("schedbench: ping failed\n");
+      exit(1);
+    }
+  }
+  wait(0);
+  exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int pairs, rounds, i, t0, t;
+
+  pairs = 4;
+  rounds = 2000;
+  if(argc > 1)
+    pairs = atoi(argv[1]);
+  if(argc > 2)
+    rounds = atoi(argv[2]);
+
+  t0 = uptime();
+  for(i = 0; i < pairs; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("schedbench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0)
+      pingpong(rounds);
+  }
+  for(i = 0; i < pairs; i++)
+    wait(0);
+  t = uptime() - t0;
+
+  printf("schedbench: %d pairs, %d round trips each, %d ticks\n",
+         pairs, rounds, t);
+  exit(0);
+}
@@ -0,0 +1,44 @@
+// sleeptest [n]: n processes sleep at once, for 1 to 50 ticks each,
+// and each checks that it slept at least as long as it asked.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+int
+main(int argc, char *argv[])
+{
+  int n, i, pid, t0, t, xstate, bad;
+
+  n = 500;
+  if(argc > 1)
+    n = atoi(argv[1]);
+
+  printf("sleeptest: %d sleepers\n", n);
+  t0 = uptime();
+  for(i = 0; i < n; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("sleeptest: fork failed after %d processes\n", i);
+      break;
+    }
+    if(pid == 0){
+      int want = i % 50 + 1;
+      int start = uptime();
+      sleep(want);
+      exit(uptime() - start < want);
+    }
+  }
+
+  bad = 0;
+  while(wait(&xstate) > 0)
+    bad += xstate != 0;
+  t = uptime() - t0;
+
+  if(i < n || bad){
+    printf("sleeptest: FAILED, %d woke early\n", bad);
+    exit(1);
+  }
+  printf("sleeptest: OK, %d sleepers done in %d ticks\n", n, t);
+  exit(0);
+}
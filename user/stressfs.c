@@ -16,22 +16,29 @@
 int
 main(int argc, char *argv[])
 {
-  int fd, i;
+  int fd, i, n, me, t0;
   char path[] = "stressfs0";
   char data[512];
 
+  // stressfs [n]: each of the 5 processes writes n*512 bytes.
+  n = 20;
+  if(argc > 1)
+    n = atoi(argv[1]);
+
   printf("stressfs starting\n");
   memset(data, 'a', sizeof(data));
 
+  t0 = uptime();
   for(i = 0; i < 4; i++)
     if(fork() > 0)
       break;
+  me = i;
 
   printf("write %d\n", i);
 
   path[8] += i;
   fd = open(path, O_CREATE | O_RDWR);
-  for(i = 0; i < 20; i++)
+  for(i = 0; i < n; i++)
 //    printf(fd, "%d\n", i);
     write(fd, data, sizeof(data));
   close(fd);
@@ -39,11 +46,17 @@ main(int argc, char *argv[])
   printf("read\n");
 
   fd = open(path, O_RDONLY);
-  for (i = 0; i < 20; i++)
+  for (i = 0; i < n; i++)
     read(fd, data, sizeof(data));
   close(fd);
 
   wait(0);
 
+  // each process waits for the one it forked, so the first
+  // one finishes last.
+  if(me == 0)
+    printf("stressfs: 5 processes wrote and read %d KB in %d ticks\n",
+           5 * n / 2, uptime() - t0);
+
   exit(0);
 }
@@ -0,0 +1,82 @@
+// threadbench [threads [work]]: split a CPU-bound loop among
+// kernel threads made with clone(), and compare the time with one
+// thread. The main thread waits for the workers on a futex-based
+// counter, then reaps them with wait(). Run it at different
+// "make CPUS=" to see it scale.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/futex.h"
+#include "user/user.h"
+
+#define MAXTHREAD 8
+#define STACKSIZE 4096
+
+int work;                  // iterations per run, split among threads
+int nthread;
+int remaining;             // workers still running
+uint64 result[MAXTHREAD*8];  // one cache line each
+
+void
+worker(void *arg)
+{
+  int id = (int)(uint64)arg;
+  uint64 x = id;
+
+  for(int i = 0; i < work / nthread; i++)
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+  result[id*8] = x;
+
+  if(__sync_sub_and_fetch(&remaining, 1) == 0)
+    futex(&remaining, FUTEX_WAKE, 0);
+  exit(0);
+}
+
+int
+run(int n)
+{
+  static char *stacks[MAXTHREAD];
+  int i, r, t0;
+
+  nthread = n;
+  remaining = n;
+  t0 = uptime();
+  for(i = 0; i < n; i++){
+    if(stacks[i] == 0)
+      stacks[i] = malloc(STACKSIZE);
+    if(clone(worker, (void*)(uint64)i, stacks[i] + STACKSIZE) < 0){
+      printf("threadbench: clone failed\n");
+      exit(1);
+    }
+  }
+  while((r = remaining) != 0)
+    futex(&remaining, FUTEX_WAIT, r);
+  t0 = uptime() - t0;
+  for(i = 0; i < n; i++)
+    wait(0);
+  return t0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int n, t1, tn;
+
+  n = 4;
+  work = 50000000;
+  if(argc > 1)
+    n = atoi(argv[1]);
+  if(argc > 2)
+    work = atoi(argv[2]);
+  if(n < 1 || n > MAXTHREAD){
+    printf("threadbench: 1 to %d threads\n", MAXTHREAD);
+    exit(1);
+  }
+
+  t1 = run(1);
+  tn = run(n);
+  printf("threadbench: 1 thread %d ticks, %d threads %d ticks\n", t1, n, tn);
+  if(tn > 0)
+    printf("threadbench: speedup %d.%d\n", t1 / tn, (t1 * 10 / tn) % 10);
+  exit(0);
+}
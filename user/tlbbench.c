@@ -0,0 +1,72 @@
+// tlbbench [mb [rounds]]: read one word from every page of an
+// mb-megabyte heap region, rounds times over, first while the
+// region is mapped with 2MB superpages and then again after
+// fork() has split them into 4096-byte pages. Each pass touches
+// far more pages than the TLB holds, so the second run shows
+// what the superpages save in TLB misses.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+uint64 sum;
+
+// read a word from each page of [a, a+n), rounds times.
+int
+sweep(char *a, uint64 n, int rounds)
+{
+  int t0, r;
+  uint64 off;
+
+  t0 = uptime();
+  for(r = 0; r < rounds; r++)
+    for(off = 0; off < n; off += PGSIZE)
+      sum += *(uint64*)(a + off);
+  return uptime() - t0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int mb, rounds, pid, tsuper, tsmall;
+  uint64 n, off;
+  char *a;
+
+  mb = 16;
+  rounds = 500;
+  if(argc > 1)
+    mb = atoi(argv[1]);
+  if(argc > 2)
+    rounds = atoi(argv[2]);
+  n = (uint64)mb << 20;
+
+  // sbrk an extra superpage's worth, to start on a 2MB boundary.
+  a = sbrk(n + SUPERPGSIZE);
+  if(a == (char*)-1){
+    printf("tlbbench: sbrk failed\n");
+    exit(1);
+  }
+  a = (char*)(((uint64)a + SUPERPGSIZE - 1) & ~(SUPERPGSIZE - 1));
+
+  // the first touch of each 2MB faults in a superpage.
+  for(off = 0; off < n; off += PGSIZE)
+    a[off] = 1;
+  tsuper = sweep(a, n, rounds);
+
+  // fork() shares the parent's memory page by page, so it
+  // splits every superpage.
+  pid = fork();
+  if(pid < 0){
+    printf("tlbbench: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0)
+    exit(0);
+  wait(0);
+  tsmall = sweep(a, n, rounds);
+
+  printf("tlbbench: %d MB, %d rounds: superpages %d ticks, pages %d ticks\n",
+         mb, rounds, tsuper, tsmall);
+  exit(sum == 0);
+}